@@ -2,7 +2,7 @@
 #include "geometry.h"
 #include "glm/fwd.hpp"
 
-AABB::AABB(const glm::dvec3& a, const glm::dvec3& b)
+AABB::AABB(const rvec3& a, const rvec3& b)
 {
   min = glm::min(a, b);
   max = glm::max(a, b);
@@ -10,14 +10,14 @@ AABB::AABB(const glm::dvec3& a, const glm::dvec3& b)
 
 AABB::AABB(const Sphere& s)
 {
-  min = glm::dvec3(s.center - s.radius);
-  max = glm::dvec3(s.center + s.radius);
+  min = rvec3(s.center - s.radius);
+  max = rvec3(s.center + s.radius);
 }
 
 AABB::AABB(const Triangle& t)
 {
-  min = glm::min(glm::min(t.v0, t.v1), t.v2);
-  max = glm::max(glm::max(t.v0, t.v1), t.v2);
+  min = glm::min(glm::min(t.vertex(0), t.vertex(1)), t.vertex(2));
+  max = glm::max(glm::max(t.vertex(0), t.vertex(1)), t.vertex(2));
 }
 
 AABB merge(const AABB& a, const AABB& b)
@@ -32,8 +32,8 @@ AABB compute_bounding_volume(const std::vector<Primitive>::const_iterator& begin
                      const std::vector<Primitive>::const_iterator& end)
 {
   AABB bbox;
-  bbox.min = glm::dvec3(+1e9);
-  bbox.max = glm::dvec3(-1e9);
+  bbox.min = rvec3(real(1e9));
+  bbox.max = rvec3(real(-1e9));
   for (auto it = begin; it != end; it++) {
     bbox.min = glm::min(bbox.min, it->bbox.min);
     bbox.max = glm::max(bbox.max, it->bbox.max);
@@ -42,14 +42,14 @@ AABB compute_bounding_volume(const std::vector<Primitive>::const_iterator& begin
   return bbox;
 }
 
-bool ray_vs_aabb(const Ray& r, const AABB& bb, Interval<double> ti)
+bool ray_vs_aabb(const Ray& r, const AABB& bb, Interval<real> ti)
 {
   for (int axis = 0; axis < 3; axis++) {
-    Interval<double> ax(bb.min[axis], bb.max[axis]);
-    double adinv = 1.0 / r.direction[axis];
+    Interval<real> ax(bb.min[axis], bb.max[axis]);
+    real adinv = real(1) / r.direction[axis];
 
-    double t0 = (ax.min - r.origin[axis]) * adinv;
-    double t1 = (ax.max - r.origin[axis]) * adinv;
+    real t0 = (ax.min - r.origin[axis]) * adinv;
+    real t1 = (ax.max - r.origin[axis]) * adinv;
 
     if (t0 < t1) {
       if (t0 > ti.min) ti.min = t0;
@@ -10,19 +10,25 @@ struct Triangle;
 struct Primitive;
 
 struct AABB {
-  glm::dvec3 min;
-  glm::dvec3 max;
+  rvec3 min;
+  rvec3 max;
 
   // generate bounding box that contains these two points
   AABB() {}
-  AABB(const glm::dvec3& a, const glm::dvec3& b);
+  AABB(const rvec3& a, const rvec3& b);
   AABB(const Sphere&);
   AABB(const Triangle&);
 
-  inline glm::dvec3 size() const { return max - min; }
+  inline rvec3 size() const { return max - min; }
 
-  inline glm::dvec3 center() const {
-    return min + size() / 2.0;
+  inline rvec3 center() const {
+    return min + size() / real(2);
+  }
+
+  inline double area() const
+  {
+    auto s = size();
+    return 2.0 * (s.x * s.y + s.y * s.z + s.z * s.x);
   }
 
   inline size_t longest_axis() const
@@ -45,4 +51,17 @@ AABB merge(const AABB& a, const AABB& b);
 AABB compute_bounding_volume(const std::vector<Primitive>::const_iterator& begin,
                              const std::vector<Primitive>::const_iterator& end);
 
-bool ray_vs_aabb(const Ray& r, const AABB& bb, Interval<double> ti);
+bool ray_vs_aabb(const Ray& r, const AABB& bb, Interval<real> ti);
+
+// branchless slab test against single precision bounds, t_entry is the distance where the ray enters the box
+inline bool ray_vs_aabb(const RayInv& r, const glm::vec3& min, const glm::vec3& max, const Interval<float>& ti,
+                        float& t_entry)
+{
+  glm::vec3 t0 = (min - r.origin) * r.inv_direction;
+  glm::vec3 t1 = (max - r.origin) * r.inv_direction;
+  glm::vec3 t_near = glm::min(t0, t1);
+  glm::vec3 t_far = glm::max(t0, t1);
+  t_entry = glm::max(glm::max(t_near.x, t_near.y), glm::max(t_near.z, ti.min));
+  float t_exit = glm::min(glm::min(t_far.x, t_far.y), glm::min(t_far.z, ti.max));
+  return t_entry <= t_exit;
+}
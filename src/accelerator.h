@@ -0,0 +1,30 @@
+#pragma once
+
+#include <optional>
+
+#include "aabb.h"
+#include "geometry.h"
+#include "packet.h"
+#include "ray.h"
+
+// Spatial index answering the two ray queries of the renderer. Implementations are built from their
+// primitives in the constructor and are immutable afterwards, so they can be queried from many threads.
+// There is no virtual build: each backend takes its own config, the wide BVHs are collapsed from a binary
+// BVH they keep referencing and the TLAS from the BVHs of its meshes. Scene::compute_accelerator is the
+// one place that picks and constructs a backend, moved primitives are handled by BVH::refit or a rebuild.
+class Accelerator
+{
+ public:
+  virtual ~Accelerator() = default;
+  // closest hit, Scene::resolve_hit computes its surface attributes
+  virtual std::optional<Hit> traverse(const Ray&) const = 0;
+  // any hit traversal, true if a primitive is closer than t_max
+  virtual bool occluded(const Ray&, real t_max) const = 0;
+  // closest hits of all rays of a packet, without packet traversal the rays are traced one by one
+  virtual void traverse_packet(const RayPacket& packet, std::optional<Hit>* hits) const
+  {
+    for (size_t i = 0; i < packet.size; i++) hits[i] = traverse(packet.rays[i]);
+  }
+  // bounds of all primitives
+  virtual const AABB& bounds() const = 0;
+};
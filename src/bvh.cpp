@@ -1,83 +1,2089 @@
 #include "bvh.h"
-#include <memory>
 #include <optional>
 #include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <omp.h>
+#include <queue>
+#include <random>
 #include "aabb.h"
 #include "geometry.h"
 
-bool BVH::Node::is_leaf() const { return left == nullptr && right == nullptr; }
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PT_SSE2 1
+#include <emmintrin.h>
+#else
+#define PT_SSE2 0
+#endif
 
-std::optional<Intersection> BVH::Node::intersect(const Ray& ray)
+// round outwards so the single precision box always contains the primitive bounds
+static glm::vec3 round_down(const rvec3& v)
 {
-  if (!ray_vs_aabb(ray, bbox, Interval<double>(0.01, 1e9))) {
-    return std::nullopt;
+  constexpr float lowest = std::numeric_limits<float>::lowest();
+  return {std::nextafter(float(v.x), lowest), std::nextafter(float(v.y), lowest), std::nextafter(float(v.z), lowest)};
+}
+
+static glm::vec3 round_up(const rvec3& v)
+{
+  constexpr float highest = std::numeric_limits<float>::max();
+  return {std::nextafter(float(v.x), highest), std::nextafter(float(v.y), highest),
+          std::nextafter(float(v.z), highest)};
+}
+
+static AABB empty_bounding_volume()
+{
+  AABB bbox;
+  bbox.min = rvec3(real(1e9));
+  bbox.max = rvec3(real(-1e9));
+  return bbox;
+}
+
+static double node_area(const BVH::Node& node)
+{
+  AABB bbox(rvec3(node.min), rvec3(node.max));
+  return bbox.area();
+}
+
+// ranges larger than this are built in their own task or binned in parallel
+static constexpr uint32_t task_threshold = 4096;
+static constexpr uint32_t parallel_threshold = 1 << 16;
+
+// split [begin, end) into chunks and run body(chunk_begin, chunk_end, chunk) on each as a task
+template <typename Body>
+static void for_each_chunk(uint32_t begin, uint32_t end, size_t chunks, const Body& body)
+{
+  uint32_t chunk_size = uint32_t((end - begin + chunks - 1) / chunks);
+  for (size_t c = 0; c < chunks; c++) {
+    uint32_t chunk_begin = std::min(end, uint32_t(begin + c * chunk_size));
+    uint32_t chunk_end = std::min(end, chunk_begin + chunk_size);
+#pragma omp task shared(body)
+    body(chunk_begin, chunk_end, c);
+  }
+#pragma omp taskwait
+}
+
+BVH::BVH(const std::vector<Primitive>& primitives, const BVHConfig& config) : m_config(config), m_primitives(primitives)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+  const int threads = (m_config.threads > 0) ? m_config.threads : omp_get_max_threads();
+
+  // the builder only moves these small references around, the primitives are reordered once at the end
+  m_references.resize(m_primitives.size());
+#pragma omp parallel for num_threads(threads)
+  for (int i = 0; i < int(m_primitives.size()); i++) {
+    m_references[i] = {m_primitives[i].bbox, m_primitives[i].bbox.center(), uint32_t(i)};
+  }
+
+  // only the construction runs on all threads, the passes after it are serial
+  auto construction_start = std::chrono::high_resolution_clock::now();
+  build(threads);
+  auto construction_end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> construction = construction_end - construction_start;
+
+  // rays traverse a lazy BVH while it is built, so the finished parts are never moved around
+  if (!m_subtrees) {
+    if (m_config.optimize_time > 0.0) optimize();
+    reorder_primitives();
   }
+  m_build_cost = m_cost = sah_cost();
 
-  if (is_leaf()) {
-    return intersect_primitives(ray);
+  const bool treelets = m_config.layout == BVHConfig::TREELET && !m_subtrees;
+  double depth_first_misses = 0.0;
+  if (treelets) {
+    depth_first_misses = cache_misses_per_ray();
+    layout_treelets();
+    reorder_primitives();
   }
 
-  auto l = left->intersect(ray);
-  auto r = right->intersect(ray);
-  return closest(l, r);
+  if (!m_subtrees) build_blocks();
+
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> duration = end - start;
+
+  const char* builder_names[] = {"MEDIAN", "SAH", "SBVH"};
+
+  std::cout << "BVH Builder: " << builder_names[m_config.builder] << ", Nodes: " << node_count()
+            << ", References: " << m_indices.size() << ", Build time: " << duration.count() << " ms, SAH cost: "
+            << m_build_cost << std::endl;
+  std::cout << "BVH Construction: " << construction.count() << " ms on " << threads
+            << " threads, Serial passes: " << duration.count() - construction.count() << " ms ("
+            << 100.0 * construction.count() / std::max(duration.count(), 1e-9) << "% in the parallel phase)"
+            << std::endl;
+
+  if (treelets) {
+    std::cout << "BVH Layout: TREELET, Cache Misses/Ray: " << cache_misses_per_ray()
+              << " (DEPTH_FIRST: " << depth_first_misses << ")" << std::endl;
+  }
 }
 
-std::optional<Intersection> BVH::Node::intersect_primitives(const Ray& ray)
+// spatial splits need the primitive geometry, boxes are always built with object splits
+static BVHConfig box_config(const BVHConfig& config)
 {
-  std::optional<Intersection> closest = std::nullopt;
+  BVHConfig c = config;
+  if (c.builder == BVHConfig::SBVH) c.builder = BVHConfig::SAH;
+  c.lazy = false;
+  return c;
+}
 
-  for (auto it = begin; it != end; ++it) {
-    auto possible_intersection = (*it).intersect(ray);
+BVH::BVH(const std::vector<AABB>& boxes, const BVHConfig& config) : m_config(box_config(config))
+{
+  const int threads = (m_config.threads > 0) ? m_config.threads : omp_get_max_threads();
 
-    if (possible_intersection.has_value()) {
-      Intersection its = possible_intersection.value();
+  m_references.resize(boxes.size());
+  for (size_t i = 0; i < boxes.size(); i++) {
+    m_references[i] = {boxes[i], boxes[i].center(), uint32_t(i)};
+  }
 
-      if (closest.has_value()) {
-        if (its.is_closer_than(closest.value())) {
-          closest = its;
-        }
+  build(threads);
+  m_build_cost = m_cost = sah_cost();
+}
+
+// build the nodes and leaf index list from m_references
+void BVH::build(int threads)
+{
+  const uint32_t count = uint32_t(m_references.size());
+
+  AABB centroids;
+  compute_bounds(m_references.data(), count, m_bounds, centroids);
+
+  if (count == 0) {
+    m_nodes.resize(1);
+  } else if (m_config.builder == BVHConfig::SBVH) {
+    m_root_area = m_bounds.area();
+    m_spatial_budget = size_t(double(count) * m_config.max_duplication);
+    m_nodes.reserve(2 * count);
+    m_indices.reserve(count);
+
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+    construct_spatial(m_references, 0);
+
+    m_nodes = compact(0, m_nodes.size());
+  } else {
+    // a binary tree with at least one primitive per leaf never has more than 2n - 1 nodes, every subtree
+    // gets a slice of that size so the tasks never have to synchronize when allocating nodes
+    m_nodes.resize(2 * count - 1);
+    m_lazy_size = m_config.lazy ? m_config.lazy_size : 0;
+
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+    construct(0, count, 0, 0);
+
+    // unbuilt ranges are written again once they are built
+    m_indices.resize(count);
+    for (uint32_t i = 0; i < count; i++) m_indices[i] = m_references[i].index;
+
+    if (m_lazy_size > 0) {
+      m_lazy_size = 0;
+      reserve_subtrees();
+      // the unbuilt subtrees still need their references
+      if (m_subtrees) return;
+    }
+
+    m_nodes = compact(0, m_nodes.size());
+  }
+
+  // both builders reserve room for the worst case
+  m_nodes.shrink_to_fit();
+  m_indices.shrink_to_fit();
+  m_references = std::vector<Reference>();
+}
+
+void BVH::refit(const std::vector<Primitive>& primitives)
+{
+  assert(primitives.size() == m_sources.size() && !m_subtrees);
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const int threads = (m_config.threads > 0) ? m_config.threads : omp_get_max_threads();
+
+#pragma omp parallel for num_threads(threads)
+  for (int i = 0; i < int(m_primitives.size()); i++) {
+    m_primitives[i] = primitives[m_sources[i]];
+  }
+
+  if (!m_primitives.empty()) {
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+    m_bounds = refit_node(0, 0);
+  }
+
+  build_blocks();
+
+  m_cost = sah_cost();
+
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> duration = end - start;
+
+  std::cout << "BVH Refit time: " << duration.count() << " ms, SAH cost: " << m_cost << " (built "
+            << m_build_cost << ")" << std::endl;
+}
+
+bool BVH::degraded() const { return m_cost > m_config.rebuild_threshold * m_build_cost; }
+
+bool BVH::bounds_valid() const
+{
+  auto contains = [](const Node& node, const rvec3& min, const rvec3& max) {
+    for (int axis = 0; axis < 3; axis++) {
+      if (double(node.min[axis]) > double(min[axis]) || double(node.max[axis]) < double(max[axis])) return false;
+    }
+    return true;
+  };
+
+  if (m_primitives.empty()) return true;
+
+  // walk the tree, the node array has unused entries to keep sibling pairs aligned
+  std::vector<uint32_t> stack = {0};
+  while (!stack.empty()) {
+    const Node& node = m_nodes[stack.back()];
+    stack.pop_back();
+    if (node.is_unbuilt()) continue;
+
+    if (node.is_leaf()) {
+      for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+        const AABB& bbox = m_primitives[m_indices[i]].bbox;
+        if (!contains(node, bbox.min, bbox.max)) return false;
+      }
+    } else {
+      for (uint32_t child = node.offset; child < node.offset + 2; child++) {
+        if (!contains(node, m_nodes[child].min, m_nodes[child].max)) return false;
+        stack.push_back(child);
+      }
+    }
+  }
+
+  return true;
+}
+
+// the top levels of the tree are refit in parallel, each subtree below them in one task
+static constexpr size_t refit_task_depth = 8;
+
+AABB BVH::refit_node(uint32_t index, size_t depth)
+{
+  Node& node = m_nodes[index];
+  AABB bbox;
+
+  if (node.is_leaf()) {
+    // leaves of spatial splits fall back to the full primitive bounds, which are larger than the clipped ones
+    bbox = empty_bounding_volume();
+    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+      bbox = merge(bbox, m_primitives[m_indices[i]].bbox);
+    }
+  } else {
+    AABB left;
+    if (depth < refit_task_depth) {
+#pragma omp task shared(left)
+      left = refit_node(node.offset, depth + 1);
+      AABB right = refit_node(node.offset + 1, depth + 1);
+#pragma omp taskwait
+      bbox = merge(left, right);
+    } else {
+      left = refit_node(node.offset, depth + 1);
+      bbox = merge(left, refit_node(node.offset + 1, depth + 1));
+    }
+  }
+
+  node.min = round_down(bbox.min);
+  node.max = round_up(bbox.max);
+  return bbox;
+}
+
+// Store the primitives in the order the leaves first reference them, so that consecutive leaf indices
+// mostly point to consecutive primitives.
+void BVH::reorder_primitives()
+{
+  std::vector<uint32_t> remap(m_primitives.size(), UINT32_MAX);
+  std::vector<Primitive> ordered;
+  std::vector<uint32_t> sources;
+  ordered.reserve(m_primitives.size());
+  sources.reserve(m_primitives.size());
+
+  for (uint32_t& index : m_indices) {
+    if (remap[index] == UINT32_MAX) {
+      remap[index] = uint32_t(ordered.size());
+      ordered.push_back(m_primitives[index]);
+      sources.push_back(m_sources.empty() ? index : m_sources[index]);
+    }
+    index = remap[index];
+  }
+
+  m_primitives = std::move(ordered);
+  m_sources = std::move(sources);
+}
+
+double BVH::sah_cost() const
+{
+  if (m_indices.empty()) return 0.0;
+
+  double root_area = node_area(m_nodes[0]);
+  double cost = 0.0;
+
+  for (const Node& node : m_nodes) {
+    double probability = node_area(node) / root_area;
+    if (node.is_unbuilt()) {
+      // built subtrees count through their own nodes, unbuilt ones as a single leaf
+      const Subtree& subtree = m_subtrees[node.offset];
+      if (!subtree.built) cost += probability * m_config.intersection_cost * (subtree.end - subtree.begin);
+    } else if (node.is_leaf()) {
+      cost += probability * m_config.intersection_cost * node.count;
+    } else {
+      cost += probability * m_config.traversal_cost;
+    }
+  }
+
+  return cost;
+}
+
+BVHStatistics BVH::statistics() const
+{
+  BVHStatistics stats;
+  stats.node_count = m_nodes.size();
+  stats.reference_count = m_indices.size();
+  stats.sah_cost = sah_cost();
+  stats.memory = m_nodes.capacity() * sizeof(Node) + m_primitives.capacity() * sizeof(Primitive) +
+                 (m_indices.capacity() + m_sources.capacity()) * sizeof(uint32_t) +
+                 m_blocks.capacity() * sizeof(TriangleBlock) + m_geometry.capacity() * sizeof(PrimitiveGeometry) +
+                 m_meshlets.capacity() + m_meshlet_offsets.capacity() * sizeof(uint32_t);
+
+  if (m_indices.empty()) return stats;
+
+  const double root_area = node_area(m_nodes[0]);
+
+  struct Entry {
+    uint32_t index;
+    size_t depth;
+  };
+
+  std::vector<Entry> stack = {{0, 0}};
+
+  while (!stack.empty()) {
+    auto [index, depth] = stack.back();
+    stack.pop_back();
+    const Node& node = m_nodes[index];
+
+    if (node.is_unbuilt()) {
+      const Subtree& subtree = m_subtrees[node.offset];
+      if (subtree.built) {
+        stack.push_back({subtree.root, depth});
       } else {
-        closest = its;
+        stats.unbuilt_count++;
+      }
+      continue;
+    }
+
+    if (node.is_leaf()) {
+      stats.leaf_count++;
+      if (stats.depth_histogram.size() <= depth) stats.depth_histogram.resize(depth + 1, 0);
+      if (stats.leaf_size_histogram.size() <= node.count) stats.leaf_size_histogram.resize(node.count + 1, 0);
+      stats.depth_histogram[depth]++;
+      stats.leaf_size_histogram[node.count]++;
+      continue;
+    }
+
+    const Node& left = m_nodes[node.offset];
+    const Node& right = m_nodes[node.offset + 1];
+    glm::vec3 min = glm::max(left.min, right.min);
+    glm::vec3 max = glm::min(left.max, right.max);
+    if (glm::all(glm::lessThan(min, max))) {
+      stats.overlap += AABB(rvec3(min), rvec3(max)).area() / root_area;
+    }
+
+    stack.push_back({node.offset + 1, depth + 1});
+    stack.push_back({node.offset, depth + 1});
+  }
+
+  // the simulation would build the subtrees of a lazy BVH
+  if (!m_subtrees) stats.cache_misses = cache_misses_per_ray();
+  return stats;
+}
+
+void BVH::print_statistics() const
+{
+  BVHStatistics stats = statistics();
+  size_t depth = stats.depth_histogram.empty() ? 0 : stats.depth_histogram.size() - 1;
+
+  std::cout << "BVH Nodes: " << stats.node_count << ", Leaves: " << stats.leaf_count
+            << ", References: " << stats.reference_count << ", Max Depth: " << depth
+            << ", Memory: " << double(stats.memory) / (1024.0 * 1024.0) << " MiB" << std::endl;
+  if (m_subtrees) {
+    std::cout << "BVH Unbuilt Subtrees: " << stats.unbuilt_count << " of " << m_subtree_count << std::endl;
+  }
+
+  // only the acceleration structure itself, without the primitives
+  size_t bytes = m_nodes.capacity() * sizeof(Node) + m_indices.capacity() * sizeof(uint32_t);
+  std::cout << "BVH Bytes/Primitive: " << double(bytes) / double(std::max(m_primitives.size(), size_t(1))) << std::endl;
+  std::cout << "BVH SAH Cost: " << stats.sah_cost << ", Overlap: " << stats.overlap
+            << ", Cache Misses/Ray: " << stats.cache_misses << std::endl;
+
+  std::cout << "BVH Leaf Depths:";
+  for (size_t depth = 0; depth < stats.depth_histogram.size(); depth++) {
+    if (stats.depth_histogram[depth] > 0) std::cout << " " << depth << ":" << stats.depth_histogram[depth];
+  }
+  std::cout << std::endl;
+
+  std::cout << "BVH Leaf Sizes:";
+  for (size_t size = 0; size < stats.leaf_size_histogram.size(); size++) {
+    if (stats.leaf_size_histogram[size] > 0) std::cout << " " << size << ":" << stats.leaf_size_histogram[size];
+  }
+  std::cout << std::endl;
+}
+
+// Single precision Moller-Trumbore test of the ray against the triangles of a block. Lanes hit well inside
+// the triangle and the interval (0, t_max) are returned in `hit` with their distance in t. Lanes close to
+// an edge or the ends of the interval, where rounding could change the result, are returned in `unsure` and
+// left to the exact test of the primitive, as are the sphere lanes.
+struct BlockResult {
+  alignas(16) float t[4];
+  int hit;
+  int unsure;
+};
+
+static BlockResult intersect_block(const BVH::TriangleBlock& block, const glm::vec3& o, const glm::vec3& d,
+                                   float t_max, int lanes)
+{
+  constexpr float slack = 1e-3f;
+  const float t_lo = -slack, t_hi = t_max * (1.0f + slack) + slack;
+  const float t_sure_lo = slack, t_sure_hi = t_max * (1.0f - slack) - slack;
+
+  BlockResult result;
+  int inside, maybe, undecided;
+
+#if PT_SSE2
+  const __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+  const __m128 e1x = _mm_load_ps(block.e1[0]), e1y = _mm_load_ps(block.e1[1]), e1z = _mm_load_ps(block.e1[2]);
+  const __m128 e2x = _mm_load_ps(block.e2[0]), e2y = _mm_load_ps(block.e2[1]), e2z = _mm_load_ps(block.e2[2]);
+
+  // p = d x e2
+  __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+  __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+  // s = o - v0
+  __m128 sx = _mm_sub_ps(_mm_set1_ps(o.x), _mm_load_ps(block.v0[0]));
+  __m128 sy = _mm_sub_ps(_mm_set1_ps(o.y), _mm_load_ps(block.v0[1]));
+  __m128 sz = _mm_sub_ps(_mm_set1_ps(o.z), _mm_load_ps(block.v0[2]));
+  __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+  // q = s x e1
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+  __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+  __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+  __m128 w = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), u), v);
+  _mm_store_ps(result.t, t);
+
+  __m128 bary_min = _mm_min_ps(_mm_min_ps(u, v), w);
+  inside = _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(bary_min, _mm_set1_ps(slack)),
+                                      _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(t_sure_lo)),
+                                                 _mm_cmple_ps(t, _mm_set1_ps(t_sure_hi)))));
+  maybe = _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(bary_min, _mm_set1_ps(-slack)),
+                                     _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(t_lo)),
+                                                _mm_cmple_ps(t, _mm_set1_ps(t_hi)))));
+  undecided = _mm_movemask_ps(_mm_or_ps(_mm_cmpunord_ps(u, v), _mm_cmpunord_ps(t, t)));
+#else
+  inside = maybe = undecided = 0;
+  for (int i = 0; i < 4; i++) {
+    glm::vec3 v0(block.v0[0][i], block.v0[1][i], block.v0[2][i]);
+    glm::vec3 e1(block.e1[0][i], block.e1[1][i], block.e1[2][i]);
+    glm::vec3 e2(block.e2[0][i], block.e2[1][i], block.e2[2][i]);
+    glm::vec3 p = glm::cross(d, e2);
+    float inv_det = 1.0f / glm::dot(e1, p);
+    glm::vec3 s = o - v0;
+    float u = glm::dot(s, p) * inv_det;
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(d, q) * inv_det;
+    float t = glm::dot(e2, q) * inv_det;
+    float bary_min = std::min(std::min(u, v), 1.0f - u - v);
+    result.t[i] = t;
+    if (bary_min >= slack && t >= t_sure_lo && t <= t_sure_hi) inside |= 1 << i;
+    if (bary_min >= -slack && t >= t_lo && t <= t_hi) maybe |= 1 << i;
+    if (std::isnan(u) || std::isnan(v) || std::isnan(t)) undecided |= 1 << i;
+  }
+#endif
+
+  result.hit = inside & ~block.scalar & lanes;
+  result.unsure = ((maybe & ~inside) | undecided | block.scalar) & lanes;
+  return result;
+}
+
+// lanes of block b that belong to the leaf with the index range [first, first + count)
+static inline int leaf_lanes(uint32_t b, uint32_t first, uint32_t count)
+{
+  int lo = int(std::max(first, 4 * b) - 4 * b), hi = int(std::min(first + count, 4 * b + 4) - 4 * b);
+  return ((1 << hi) - 1) & ~((1 << lo) - 1);
+}
+
+std::optional<Hit> BVH::intersect_leaf(uint32_t first, uint32_t count, const Ray& ray, real t_max) const
+{
+  if (!m_meshlets.empty()) return intersect_meshlet(first, count, ray, t_max);
+
+  std::optional<Hit> closest = std::nullopt;
+
+  if (m_blocks.empty()) {
+    for (uint32_t i = first; i < first + count; ++i) {
+      // every hit shortens the interval, so the last hit is always the closest
+      auto hit = m_primitives[m_indices[i]].intersect(ray, t_max);
+
+      if (hit.has_value()) {
+        closest = hit;
+        t_max = closest->t;
+      }
+    }
+    return closest;
+  }
+
+  // Unsure lanes are tested exactly right away, of the sure hits only the nearest one is tested exactly to
+  // get its precise distance.
+  const glm::vec3 o(ray.origin), d(ray.direction);
+  const uint32_t begin = first / 4, end = (first + count + 3) / 4;
+  uint32_t closest_entry = UINT32_MAX, nearest_sure = UINT32_MAX;
+  rvec2 closest_barycentrics;
+  float nearest_sure_t = std::numeric_limits<float>::max();
+  uint64_t tests = 0;
+
+  for (uint32_t b = begin; b < end; b++) {
+    const TriangleBlock& block = m_blocks[b];
+    const int lanes = leaf_lanes(b, first, count);
+    BlockResult result = intersect_block(block, o, d, float(t_max), lanes);
+    // lanes tested exactly are counted by the primitive
+    tests += std::popcount(unsigned(lanes & ~block.scalar & ~result.unsure));
+
+    for (int mask = result.hit; mask != 0; mask &= mask - 1) {
+      int lane = std::countr_zero(unsigned(mask));
+      if (result.t[lane] < nearest_sure_t) {
+        nearest_sure_t = result.t[lane];
+        nearest_sure = 4 * b + uint32_t(lane);
+      }
+    }
+
+    for (int mask = result.unsure; mask != 0; mask &= mask - 1) {
+      uint32_t entry = 4 * b + uint32_t(std::countr_zero(unsigned(mask)));
+      real t;
+      rvec2 barycentrics;
+      if (m_geometry[entry].intersect(ray, t_max, t, barycentrics)) {
+        closest_entry = entry;
+        closest_barycentrics = barycentrics;
+        t_max = t;
       }
     }
   }
+
+  if (nearest_sure != UINT32_MAX) {
+    tests--;
+    real t;
+    rvec2 barycentrics;
+    if (m_geometry[nearest_sure].intersect(ray, t_max, t, barycentrics)) {
+      closest_entry = nearest_sure;
+      closest_barycentrics = barycentrics;
+      t_max = t;
+    }
+  }
+
+  count_intersection_tests(tests);
+  if (closest_entry != UINT32_MAX) closest = Hit{t_max, closest_barycentrics, &m_primitives[m_indices[closest_entry]]};
   return closest;
 }
 
-BVH::BVH(const std::vector<Primitive>& primitives) : m_primitives(primitives)
+bool BVH::occlude_leaf(uint32_t first, uint32_t count, const Ray& ray, real t_max) const
+{
+  if (!m_meshlets.empty()) return occlude_meshlet(first, count, ray, t_max);
+
+  if (m_blocks.empty()) {
+    for (uint32_t i = first; i < first + count; ++i) {
+      if (m_primitives[m_indices[i]].occludes(ray, t_max)) return true;
+    }
+    return false;
+  }
+
+  const glm::vec3 o(ray.origin), d(ray.direction);
+  const uint32_t begin = first / 4, end = (first + count + 3) / 4;
+  uint64_t tests = 0;
+  bool occluded = false;
+
+  for (uint32_t b = begin; b < end && !occluded; b++) {
+    const TriangleBlock& block = m_blocks[b];
+    const int lanes = leaf_lanes(b, first, count);
+    BlockResult result = intersect_block(block, o, d, float(t_max), lanes);
+    // lanes tested exactly are counted by the primitive
+    tests += std::popcount(unsigned(lanes & ~block.scalar & ~result.unsure));
+    occluded = result.hit != 0;
+
+    for (int mask = result.unsure; mask != 0 && !occluded; mask &= mask - 1) {
+      occluded = m_geometry[4 * b + uint32_t(std::countr_zero(unsigned(mask)))].occludes(ray, t_max);
+    }
+  }
+
+  count_intersection_tests(tests);
+  return occluded;
+}
+
+// pack the index list into blocks of four, a leaf uses the lanes of its range of the list
+void BVH::build_blocks()
 {
-  m_root = construct(m_primitives.begin(), m_primitives.end());
+  m_blocks.clear();
+  m_geometry.clear();
+  m_meshlets.clear();
+  m_meshlet_offsets.clear();
+
+  // without triangles every lane would be tested one by one anyway
+  auto is_triangle = [](const Primitive& p) { return p.type == Primitive::TRIANGLE; };
+  if (std::none_of(m_primitives.begin(), m_primitives.end(), is_triangle)) return;
+
+  if (m_config.meshlets) {
+    build_meshlets();
+    return;
+  }
+
+  m_blocks.assign((m_indices.size() + 3) / 4, TriangleBlock{});
+  m_geometry.reserve(m_indices.size());
+
+  for (size_t i = 0; i < m_indices.size(); i++) {
+    TriangleBlock& block = m_blocks[i / 4];
+    const uint32_t lane = uint32_t(i % 4);
+    const Primitive& primitive = m_primitives[m_indices[i]];
+    m_geometry.emplace_back(primitive);
+
+    if (primitive.type != Primitive::TRIANGLE) {
+      block.scalar |= 1 << lane;
+      continue;
+    }
+
+    const auto& triangle = m_geometry.back().triangle;
+    for (int axis = 0; axis < 3; axis++) {
+      block.v0[axis][lane] = float(triangle.v0[axis]);
+      block.e1[axis][lane] = float(triangle.e1[axis]);
+      block.e2[axis][lane] = float(triangle.e2[axis]);
+    }
+  }
 }
 
-std::optional<Intersection> BVH::traverse(const Ray& ray) { return m_root->intersect(ray); }
+// Largest distance a vertex may move by quantization, relative to the smallest height of its triangle. Far
+// below the slack of the block test, so the quantized triangles decide the same lanes as the exact ones.
+static constexpr double meshlet_tolerance = 1e-4;
 
-std::unique_ptr<BVH::Node> BVH::construct(const std::vector<Primitive>::iterator& begin,
-                                          const std::vector<Primitive>::iterator& end)
+// pack the entries of every leaf into a meshlet, vertices are shared through the mesh indices of the triangles
+void BVH::build_meshlets()
 {
-  auto node = std::make_unique<BVH::Node>();
+  m_meshlet_offsets.assign(m_indices.size(), 0);
+  size_t exact_count = 0, leaf_count = 0;
 
-  // compute bbox
-  node->bbox = compute_bounding_volume(begin, end);
+  struct Key {
+    const Mesh* mesh;
+    uint32_t position;
+    bool operator==(const Key&) const = default;
+  };
+  std::vector<Key> keys;
+  std::vector<uint16_t> vertices;
+  std::vector<uint8_t> local;
 
-  // split along axis
-  size_t split_axis = node->bbox.longest_axis();
+  for (const Node& node : m_nodes) {
+    if (!node.is_leaf()) continue;
+    leaf_count++;
 
-  size_t count = end - begin;
+    // spatial splits clip the node box, the grid has to cover the whole primitives
+    AABB bounds = empty_bounding_volume();
+    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+      bounds = merge(bounds, m_primitives[m_indices[i]].bbox);
+    }
+    const glm::vec3 min = round_down(bounds.min), max = round_up(bounds.max);
 
-  if (count > split_threshold) {
-    // sort primitives along split axis
-    auto heuristic = [split_axis](Primitive a, Primitive b) { return a.bbox.min[split_axis] < b.bbox.min[split_axis]; };
-    std::sort(begin, end, heuristic);
+    Meshlet header = {};
+    for (int axis = 0; axis < 3; axis++) {
+      header.origin[axis] = min[axis];
+      header.scale[axis] = (max[axis] - min[axis]) / 65535.0f;
+    }
+    const double error = 0.5 * glm::length(glm::dvec3(header.scale[0], header.scale[1], header.scale[2]));
 
-    std::vector<Primitive>::iterator middle = begin + (count / 2);
+    keys.clear();
+    vertices.clear();
+    local.clear();
 
-    node->left = construct(begin, middle);
-    node->right = construct(middle, end);
-  } else {
-    // insert primitives into nodes
-    node->begin = begin;
-    node->end = end;
+    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+      const Primitive& primitive = m_primitives[m_indices[i]];
+      bool fits = primitive.type == Primitive::TRIANGLE;
+
+      if (fits) {
+        const Triangle& triangle = primitive.triangle;
+        const glm::dvec3 a = triangle.vertex(0), b = triangle.vertex(1), c = triangle.vertex(2);
+        double twice_area = glm::length(glm::cross(b - a, c - a));
+        double longest = std::max({glm::length(b - a), glm::length(c - b), glm::length(a - c)});
+        fits = twice_area > 0.0 && error <= meshlet_tolerance * twice_area / longest;
+        // room for three new vertices, the last index is reserved for `exact`
+        fits = fits && keys.size() + 3 <= Meshlet::exact;
+      }
+
+      if (!fits) {
+        local.insert(local.end(), 3, Meshlet::exact);
+        exact_count++;
+        continue;
+      }
+
+      for (int corner = 0; corner < 3; corner++) {
+        const Key key = {primitive.triangle.mesh, primitive.triangle.index(corner).position};
+        auto it = std::find(keys.begin(), keys.end(), key);
+
+        if (it == keys.end()) {
+          const rvec3& p = primitive.triangle.vertex(corner);
+          for (int axis = 0; axis < 3; axis++) {
+            const float scale = header.scale[axis];
+            float cells = scale > 0.0f ? (float(p[axis]) - header.origin[axis]) / scale : 0.0f;
+            vertices.push_back(uint16_t(std::clamp(std::lround(cells), 0l, 65535l)));
+          }
+          it = keys.insert(keys.end(), key);
+        }
+        local.push_back(uint8_t(it - keys.begin()));
+      }
+    }
+
+    header.vertex_count = uint8_t(keys.size());
+    m_meshlet_offsets[node.offset] = uint32_t(m_meshlets.size());
+
+    const size_t offset = m_meshlets.size();
+    const size_t size = sizeof(Meshlet) + vertices.size() * sizeof(uint16_t) + local.size();
+    m_meshlets.resize(offset + (size + 3) / 4 * 4);
+    std::memcpy(&m_meshlets[offset], &header, sizeof(Meshlet));
+    std::memcpy(&m_meshlets[offset + sizeof(Meshlet)], vertices.data(), vertices.size() * sizeof(uint16_t));
+    std::memcpy(&m_meshlets[offset + sizeof(Meshlet) + vertices.size() * sizeof(uint16_t)], local.data(), local.size());
+  }
+
+  m_meshlets.shrink_to_fit();
+
+  const double entries = double(std::max(m_indices.size(), size_t(1)));
+  std::cout << "BVH Meshlets: " << leaf_count << ", Bytes/Entry: " << double(m_meshlets.size()) / entries
+            << ", Exact Entries: " << exact_count << std::endl;
+}
+
+// Decode four entries of a meshlet, starting at the local indices given, into a block. Lanes outside the
+// mask and entries without vertices are marked scalar and left to the exact test.
+static void decode_meshlet(const BVH::Meshlet& header, const uint8_t* vertices, const uint8_t* local, int lanes,
+                           BVH::TriangleBlock& block)
+{
+  block.scalar = 0;
+
+  for (int lane = 0; lane < 4; lane++) {
+    if (!(lanes & (1 << lane)) || local[3 * lane] == BVH::Meshlet::exact) {
+      for (int axis = 0; axis < 3; axis++) block.v0[axis][lane] = block.e1[axis][lane] = block.e2[axis][lane] = 0.0f;
+      block.scalar |= 1 << lane;
+      continue;
+    }
+
+    glm::vec3 v[3];
+    for (int corner = 0; corner < 3; corner++) {
+      uint16_t cells[3];
+      std::memcpy(cells, vertices + 3 * sizeof(uint16_t) * local[3 * lane + corner], sizeof(cells));
+      for (int axis = 0; axis < 3; axis++) {
+        v[corner][axis] = header.origin[axis] + float(cells[axis]) * header.scale[axis];
+      }
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+      block.v0[axis][lane] = v[0][axis];
+      block.e1[axis][lane] = v[1][axis] - v[0][axis];
+      block.e2[axis][lane] = v[2][axis] - v[0][axis];
+    }
+  }
+}
+
+// same as the block leaf test, with the blocks decoded from the meshlet and the exact tests done by the primitives
+std::optional<Hit> BVH::intersect_meshlet(uint32_t first, uint32_t count, const Ray& ray, real t_max) const
+{
+  const uint8_t* meshlet = &m_meshlets[m_meshlet_offsets[first]];
+  Meshlet header;
+  std::memcpy(&header, meshlet, sizeof(Meshlet));
+  const uint8_t* vertices = meshlet + sizeof(Meshlet);
+  const uint8_t* local = vertices + 3 * sizeof(uint16_t) * header.vertex_count;
+
+  const glm::vec3 o(ray.origin), d(ray.direction);
+  uint32_t closest_entry = UINT32_MAX, nearest_sure = UINT32_MAX;
+  rvec2 closest_barycentrics;
+  float nearest_sure_t = std::numeric_limits<float>::max();
+  uint64_t tests = 0;
+  TriangleBlock block;
+
+  for (uint32_t group = 0; group < count; group += 4) {
+    const int lanes = (1 << std::min(count - group, 4u)) - 1;
+    decode_meshlet(header, vertices, local + 3 * group, lanes, block);
+    BlockResult result = intersect_block(block, o, d, float(t_max), lanes);
+    tests += std::popcount(unsigned(lanes & ~block.scalar & ~result.unsure));
+
+    for (int mask = result.hit; mask != 0; mask &= mask - 1) {
+      int lane = std::countr_zero(unsigned(mask));
+      if (result.t[lane] < nearest_sure_t) {
+        nearest_sure_t = result.t[lane];
+        nearest_sure = first + group + uint32_t(lane);
+      }
+    }
+
+    for (int mask = result.unsure; mask != 0; mask &= mask - 1) {
+      uint32_t entry = first + group + uint32_t(std::countr_zero(unsigned(mask)));
+      real t;
+      rvec2 barycentrics;
+      if (m_primitives[m_indices[entry]].intersect(ray, t_max, t, barycentrics)) {
+        closest_entry = entry;
+        closest_barycentrics = barycentrics;
+        t_max = t;
+      }
+    }
+  }
+
+  if (nearest_sure != UINT32_MAX) {
+    tests--;
+    real t;
+    rvec2 barycentrics;
+    if (m_primitives[m_indices[nearest_sure]].intersect(ray, t_max, t, barycentrics)) {
+      closest_entry = nearest_sure;
+      closest_barycentrics = barycentrics;
+      t_max = t;
+    }
+  }
+
+  count_intersection_tests(tests);
+  if (closest_entry == UINT32_MAX) return std::nullopt;
+  return Hit{t_max, closest_barycentrics, &m_primitives[m_indices[closest_entry]]};
+}
+
+bool BVH::occlude_meshlet(uint32_t first, uint32_t count, const Ray& ray, real t_max) const
+{
+  const uint8_t* meshlet = &m_meshlets[m_meshlet_offsets[first]];
+  Meshlet header;
+  std::memcpy(&header, meshlet, sizeof(Meshlet));
+  const uint8_t* vertices = meshlet + sizeof(Meshlet);
+  const uint8_t* local = vertices + 3 * sizeof(uint16_t) * header.vertex_count;
+
+  const glm::vec3 o(ray.origin), d(ray.direction);
+  uint64_t tests = 0;
+  bool occluded = false;
+  TriangleBlock block;
+
+  for (uint32_t group = 0; group < count && !occluded; group += 4) {
+    const int lanes = (1 << std::min(count - group, 4u)) - 1;
+    decode_meshlet(header, vertices, local + 3 * group, lanes, block);
+    BlockResult result = intersect_block(block, o, d, float(t_max), lanes);
+    tests += std::popcount(unsigned(lanes & ~block.scalar & ~result.unsure));
+    occluded = result.hit != 0;
+
+    for (int mask = result.unsure; mask != 0 && !occluded; mask &= mask - 1) {
+      uint32_t entry = first + group + uint32_t(std::countr_zero(unsigned(mask)));
+      occluded = m_primitives[m_indices[entry]].occludes(ray, t_max);
+    }
+  }
+
+  count_intersection_tests(tests);
+  return occluded;
+}
+
+// Closest hit traversal: both children are tested at their parent, the nearer one is visited first and
+// the farther one is pushed with its entry distance. Once a hit is found, subtrees that start behind it
+// are skipped when they are popped from the stack.
+std::optional<Hit> BVH::traverse(const Ray& ray) const
+{
+  uint64_t visits = 0;
+  auto result = traverse(ray, 1e9, visits);
+  count_ray(visits);
+  return result;
+}
+
+// traversal without memory access tracking
+struct NoObserver {
+  inline void access(const void*, size_t) {}
+};
+
+std::optional<Hit> BVH::traverse(const Ray& ray, real t_max, uint64_t& visits) const
+{
+  NoObserver observer;
+  return closest_hit(ray, t_max, visits, observer);
+}
+
+template <typename Observer>
+std::optional<Hit> BVH::closest_hit(const Ray& ray, real t_max, uint64_t& visits, Observer& observer) const
+{
+  if (m_primitives.empty()) return std::nullopt;
+
+  const RayInv ray_inv(ray);
+  Interval<float> ti = Interval<float>(float(ray_epsilon), std::nextafter(float(t_max), 1e9f));
+
+  std::optional<Hit> result = std::nullopt;
+
+  struct Entry {
+    uint32_t index;
+    float t_entry;
+  };
+
+  Entry stack[max_depth];
+  size_t stack_size = 0;
+  uint32_t index = 0;
+  float t_entry;
+
+  observer.access(&m_nodes[0], sizeof(Node));
+  if (!ray_vs_aabb(ray_inv, m_nodes[0].min, m_nodes[0].max, ti, t_entry)) {
+    return std::nullopt;
   }
 
-  return node;
-}
\ No newline at end of file
+  while (true) {
+    const Node& node = m_nodes[index];
+    visits++;
+
+    if (node.is_unbuilt()) {
+      index = build_subtree(node.offset);
+      continue;
+    }
+
+    if (node.is_leaf()) {
+      if (!m_meshlets.empty()) {
+        const uint8_t* meshlet = &m_meshlets[m_meshlet_offsets[node.offset]];
+        observer.access(&m_meshlet_offsets[node.offset], sizeof(uint32_t));
+        observer.access(meshlet, sizeof(Meshlet) + 3 * sizeof(uint16_t) * meshlet[offsetof(Meshlet, vertex_count)] +
+                                     3 * node.count);
+      } else if (m_blocks.empty()) {
+        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+          observer.access(&m_indices[i], sizeof(uint32_t));
+          observer.access(&m_primitives[m_indices[i]], sizeof(Primitive));
+        }
+      } else {
+        uint32_t begin = node.offset / 4, end = (node.offset + node.count + 3) / 4;
+        observer.access(&m_blocks[begin], (end - begin) * sizeof(TriangleBlock));
+      }
+
+      auto hit = intersect_leaf(node.offset, node.count, ray, t_max);
+      if (hit.has_value()) {
+        result = hit;
+        t_max = hit->t;
+        ti.max = std::nextafter(float(t_max), std::numeric_limits<float>::max());
+      }
+    } else {
+      uint32_t left = node.offset, right = node.offset + 1;
+      float t_left, t_right;
+      observer.access(&m_nodes[left], 2 * sizeof(Node));
+      bool hit_left = ray_vs_aabb(ray_inv, m_nodes[left].min, m_nodes[left].max, ti, t_left);
+      bool hit_right = ray_vs_aabb(ray_inv, m_nodes[right].min, m_nodes[right].max, ti, t_right);
+
+      if (hit_left && hit_right) {
+        uint32_t near = left, far = right;
+        if (t_right < t_left) {
+          std::swap(near, far);
+          std::swap(t_left, t_right);
+        }
+        stack[stack_size++] = {far, t_right};
+        index = near;
+      } else if (hit_left || hit_right) {
+        index = hit_left ? left : right;
+      } else {
+        index = UINT32_MAX;
+      }
+
+      if (index != UINT32_MAX) {
+        const Node& next = m_nodes[index];
+        if (next.is_unbuilt()) {
+          // the offset of an unbuilt node is the subtree, not a range of the index list
+          prefetch(&m_subtrees[next.offset]);
+        } else if (!next.is_leaf()) {
+          prefetch(&m_nodes[next.offset]);
+        } else if (!m_meshlets.empty()) {
+          prefetch(&m_meshlets[m_meshlet_offsets[next.offset]]);
+        } else if (!m_blocks.empty()) {
+          prefetch(&m_blocks[next.offset / 4]);
+        } else {
+          prefetch(&m_primitives[m_indices[next.offset]]);
+        }
+        continue;
+      }
+    }
+
+    // pop the next subtree that still starts before the closest hit
+    while (stack_size > 0 && stack[stack_size - 1].t_entry > ti.max) stack_size--;
+
+    if (stack_size == 0) break;
+    index = stack[--stack_size].index;
+  }
+
+  return result;
+}
+
+// Packet traversal for coherent rays. Each node is first tested against the whole packet with interval
+// arithmetic, which rejects most missed nodes with one test, and the nodes that pass are tested ray by
+// ray. Leaves only intersect the rays that hit them. Without a hit order per ray, the children are
+// visited in the order the common direction of the packet passes them.
+void BVH::traverse_packet(const RayPacket& packet, std::optional<Hit>* hits) const
+{
+  if (m_primitives.empty() || !packet.coherent) {
+    Accelerator::traverse_packet(packet, hits);
+    return;
+  }
+
+  real t_max[RayPacket::max_size];
+  float t_far[RayPacket::max_size];
+  float packet_t_far = std::nextafter(1e9f, std::numeric_limits<float>::max());
+
+  for (size_t i = 0; i < packet.size; i++) {
+    hits[i] = std::nullopt;
+    t_max[i] = 1e9;
+    t_far[i] = packet_t_far;
+  }
+
+  uint32_t stack[max_depth];
+  size_t stack_size = 0;
+  uint32_t index = 0;
+  uint64_t visits[RayPacket::max_size] = {};
+
+  while (true) {
+    const Node& node = m_nodes[index];
+
+    uint64_t mask = 0;
+    if (packet_may_hit(packet, node.min, node.max, float(ray_epsilon), packet_t_far)) {
+      mask = packet_vs_aabb(packet, node.min, node.max, float(ray_epsilon), t_far);
+    }
+    // like a single ray, a lane visits the nodes whose box it hits
+    for (uint64_t m = mask; m != 0; m &= m - 1) visits[std::countr_zero(m)]++;
+
+    if (mask != 0) {
+      if (node.is_unbuilt()) {
+        index = build_subtree(node.offset);
+        continue;
+      } else if (node.is_leaf()) {
+        for (uint64_t m = mask; m != 0; m &= m - 1) {
+          size_t i = std::countr_zero(m);
+          auto hit = intersect_leaf(node.offset, node.count, packet.rays[i], t_max[i]);
+          if (hit.has_value()) {
+            hits[i] = hit;
+            t_max[i] = hit->t;
+            t_far[i] = std::nextafter(float(t_max[i]), std::numeric_limits<float>::max());
+          }
+        }
+        packet_t_far = *std::max_element(t_far, t_far + packet.size);
+      } else {
+        // visit the child first that comes first along the axis separating the children the most
+        uint32_t near = node.offset, far = node.offset + 1;
+        glm::vec3 separation = (m_nodes[far].min + m_nodes[far].max) - (m_nodes[near].min + m_nodes[near].max);
+        glm::vec3 distance = glm::abs(separation);
+        int axis = (distance.x > distance.y) ? (distance.x > distance.z ? 0 : 2) : (distance.y > distance.z ? 1 : 2);
+        if ((separation[axis] < 0.0f) == (packet.inv_direction_min[axis] > 0.0f)) std::swap(near, far);
+
+        prefetch(&m_nodes[near]);
+        stack[stack_size++] = far;
+        index = near;
+        continue;
+      }
+    }
+
+    if (stack_size == 0) break;
+    index = stack[--stack_size];
+  }
+
+  for (size_t i = 0; i < packet.size; i++) count_ray(visits[i]);
+}
+
+bool BVH::occluded(const Ray& ray, real t_max) const
+{
+  uint64_t visits = 0;
+  bool result = occluded(ray, t_max, visits);
+  count_ray(visits);
+  return result;
+}
+
+bool BVH::occluded(const Ray& ray, real t_max, uint64_t& visits) const
+{
+  if (m_primitives.empty()) return false;
+
+  const RayInv ray_inv(ray);
+  const Interval<float> ti = Interval<float>(float(ray_epsilon), std::nextafter(float(t_max), 1e9f));
+
+  uint32_t stack[max_depth];
+  size_t stack_size = 0;
+  uint32_t index = 0;
+
+  while (true) {
+    const Node& node = m_nodes[index];
+    float t_entry;
+    visits++;
+
+    if (ray_vs_aabb(ray_inv, node.min, node.max, ti, t_entry)) {
+      if (node.is_unbuilt()) {
+        index = build_subtree(node.offset);
+        continue;
+      } else if (node.is_leaf()) {
+        if (occlude_leaf(node.offset, node.count, ray, t_max)) return true;
+      } else {
+        prefetch(&m_nodes[node.offset]);
+        stack[stack_size++] = node.offset + 1;
+        index = node.offset;
+        continue;
+      }
+    }
+
+    if (stack_size == 0) break;
+    index = stack[--stack_size];
+  }
+
+  return false;
+}
+
+void BVH::construct(uint32_t begin, uint32_t end, uint32_t index, size_t depth)
+{
+  Node& node = m_nodes[index];
+  Reference* refs = m_references.data() + begin;
+
+  AABB bbox, centroids;
+  uint32_t count = end - begin;
+  compute_bounds(refs, count, bbox, centroids);
+  node.min = round_down(bbox.min);
+  node.max = round_up(bbox.max);
+
+  // lazy builds leave smaller ranges to the first ray that reaches them
+  if (count <= m_lazy_size && count > m_config.max_leaf_size) {
+    node.offset = begin;
+    node.count = Node::unbuilt | count;
+    return;
+  }
+
+  uint32_t left_count = 0;
+  bool split = count > m_config.min_leaf_size && depth + 1 < max_depth;
+
+  if (split) {
+    if (m_config.builder == BVHConfig::MEDIAN) {
+      split = count > m_config.max_leaf_size;
+      if (split) left_count = split_median(refs, count, bbox.longest_axis());
+    } else {
+      split = split_sah(refs, count, bbox, centroids, left_count);
+    }
+  }
+
+  if (!split) {
+    // insert primitives into nodes
+    node.offset = begin;
+    node.count = count;
+    return;
+  }
+
+  // the left subtree occupies the 2 * left_count - 1 slots after this node
+  uint32_t middle = begin + left_count;
+  uint32_t left = index + 1;
+  uint32_t right = index + 2 * left_count;
+  node.offset = right;
+  node.count = 0;
+
+  if (count > task_threshold) {
+#pragma omp task
+    construct(begin, middle, left, depth + 1);
+  } else {
+    construct(begin, middle, left, depth + 1);
+  }
+
+  construct(middle, end, right, depth + 1);
+}
+
+void BVH::compute_bounds(const Reference* refs, uint32_t count, AABB& bbox, AABB& centroids) const
+{
+  auto bounds = [refs](uint32_t chunk_begin, uint32_t chunk_end, AABB& bb, AABB& cb) {
+    bb = cb = empty_bounding_volume();
+    for (uint32_t i = chunk_begin; i < chunk_end; i++) {
+      const Reference& ref = refs[i];
+      bb.min = glm::min(bb.min, ref.bbox.min);
+      bb.max = glm::max(bb.max, ref.bbox.max);
+      cb.min = glm::min(cb.min, ref.centroid);
+      cb.max = glm::max(cb.max, ref.centroid);
+    }
+  };
+
+  if (count <= parallel_threshold) {
+    bounds(0, count, bbox, centroids);
+    return;
+  }
+
+  const size_t chunks = omp_get_num_threads();
+  std::vector<AABB> chunk_bbox(chunks), chunk_centroids(chunks);
+  for_each_chunk(0, count, chunks,
+                 [&](uint32_t b, uint32_t e, size_t c) { bounds(b, e, chunk_bbox[c], chunk_centroids[c]); });
+
+  bbox = centroids = empty_bounding_volume();
+  for (size_t c = 0; c < chunks; c++) {
+    bbox = merge(bbox, chunk_bbox[c]);
+    centroids = merge(centroids, chunk_centroids[c]);
+  }
+}
+
+uint32_t BVH::split_median(Reference* refs, uint32_t count, size_t axis)
+{
+  // only the median has to be in place, both halves may stay unsorted
+  auto heuristic = [axis](const Reference& a, const Reference& b) { return a.bbox.min[axis] < b.bbox.min[axis]; };
+  uint32_t middle = count / 2;
+  std::nth_element(refs, refs + middle, refs + count, heuristic);
+  return middle;
+}
+
+// bin of a centroid for object splits
+static size_t object_bin(const rvec3& centroid, const AABB& centroids, size_t axis, size_t bin_count)
+{
+  double extent = std::max(double(centroids.max[axis] - centroids.min[axis]), 1e-12);
+  double scale = double(bin_count) / extent;
+  return std::min(bin_count - 1, size_t((centroid[axis] - centroids.min[axis]) * scale));
+}
+
+// binned surface area heuristic, see "On fast Construction of SAH-based Bounding Volume Hierarchies" (Wald 2007)
+BVH::Split BVH::find_object_split(const Reference* refs, uint32_t count, const AABB& centroids) const
+{
+  struct Bin {
+    AABB bbox;
+    uint32_t count;
+  };
+
+  using Bins = std::array<std::array<Bin, max_bins>, 3>;
+
+  // only the bins in use are initialized, this runs for every node
+  auto clear = [](Bins& bins, size_t bin_count) {
+    for (auto& axis_bins : bins) {
+      for (size_t b = 0; b < bin_count; b++) axis_bins[b] = {empty_bounding_volume(), 0};
+    }
+  };
+
+  auto grow = [](Bin& bin, const AABB& bbox, uint32_t count) {
+    bin.bbox.min = glm::min(bin.bbox.min, bbox.min);
+    bin.bbox.max = glm::max(bin.bbox.max, bbox.max);
+    bin.count += count;
+  };
+
+  const size_t bin_count = std::clamp(m_config.bins, size_t(2), max_bins);
+  const glm::dvec3 extent = centroids.max - centroids.min;
+
+  // bin by centroid, as the primitive bounds may all overlap
+  auto fill = [&](uint32_t chunk_begin, uint32_t chunk_end, Bins& bins) {
+    for (uint32_t i = chunk_begin; i < chunk_end; i++) {
+      const Reference& ref = refs[i];
+      for (size_t axis = 0; axis < 3; axis++) {
+        grow(bins[axis][object_bin(ref.centroid, centroids, axis, bin_count)], ref.bbox, 1);
+      }
+    }
+  };
+
+  Bins bins;
+  clear(bins, bin_count);
+
+  if (count <= parallel_threshold) {
+    fill(0, count, bins);
+  } else {
+    const size_t chunks = omp_get_num_threads();
+    std::vector<Bins> chunk_bins(chunks);
+    for_each_chunk(0, count, chunks, [&](uint32_t b, uint32_t e, size_t c) {
+      clear(chunk_bins[c], bin_count);
+      fill(b, e, chunk_bins[c]);
+    });
+
+    for (const Bins& partial : chunk_bins) {
+      for (size_t axis = 0; axis < 3; axis++) {
+        for (size_t b = 0; b < bin_count; b++) grow(bins[axis][b], partial[axis][b].bbox, partial[axis][b].count);
+      }
+    }
+  }
+
+  Split best;
+
+  for (size_t axis = 0; axis < 3; axis++) {
+    if (extent[axis] <= 0.0) continue;
+
+    // sweep from the right to get the bounds and count right of each split plane
+    std::array<AABB, max_bins> right_bbox;
+    std::array<uint32_t, max_bins> right_count;
+    Bin right = {empty_bounding_volume(), 0};
+    for (size_t b = bin_count - 1; b > 0; b--) {
+      grow(right, bins[axis][b].bbox, bins[axis][b].count);
+      right_bbox[b] = right.bbox;
+      right_count[b] = right.count;
+    }
+
+    // split plane b separates bins [0, b) from [b, bin_count)
+    Bin left = {empty_bounding_volume(), 0};
+    for (size_t b = 1; b < bin_count; b++) {
+      grow(left, bins[axis][b - 1].bbox, bins[axis][b - 1].count);
+      if (left.count == 0 || right_count[b] == 0) continue;
+
+      double cost = left.bbox.area() * left.count + right_bbox[b].area() * right_count[b];
+      if (cost < best.cost) {
+        best = {cost, axis, b, 0.0, left.bbox, right_bbox[b]};
+      }
+    }
+  }
+
+  return best;
+}
+
+// SAH cost of splitting compared to the cost of a leaf with all count primitives
+bool BVH::worth_splitting(uint32_t count, const AABB& bbox, double split_cost) const
+{
+  double area = std::max(bbox.area(), std::numeric_limits<double>::min());
+  double cost = m_config.traversal_cost + m_config.intersection_cost * split_cost / area;
+  double leaf_cost = m_config.intersection_cost * count;
+  return count > m_config.max_leaf_size || cost < leaf_cost;
+}
+
+bool BVH::split_sah(Reference* refs, uint32_t count, const AABB& bbox, const AABB& centroids, uint32_t& left_count)
+{
+  Split split = find_object_split(refs, count, centroids);
+
+  if (split.bin == 0) {
+    // all centroids coincide, fall back to splitting the range in half
+    if (count <= m_config.max_leaf_size) return false;
+    left_count = split_median(refs, count, bbox.longest_axis());
+    return true;
+  }
+
+  if (!worth_splitting(count, bbox, split.cost)) {
+    return false;
+  }
+
+  const size_t bin_count = std::clamp(m_config.bins, size_t(2), max_bins);
+  auto it = std::partition(refs, refs + count, [&](const Reference& ref) {
+    return object_bin(ref.centroid, centroids, split.axis, bin_count) < split.bin;
+  });
+
+  left_count = uint32_t(it - refs);
+  return true;
+}
+
+// Spatial split BVH, see "Spatial Splits in Bounding Volume Hierarchies" (Stich et al. 2009). Besides
+// object splits, a node may be cut by a plane, in which case the primitives that straddle the plane are
+// referenced from both children with their bounds clipped to either side. References change in number,
+// so the builder recurses over separate arrays and appends nodes and leaf indices in depth-first order.
+uint32_t BVH::construct_spatial(std::vector<Reference>& refs, size_t depth)
+{
+  uint32_t index = uint32_t(m_nodes.size());
+  m_nodes.emplace_back();
+
+  uint32_t count = uint32_t(refs.size());
+  AABB bbox, centroids;
+  compute_bounds(refs.data(), count, bbox, centroids);
+  m_nodes[index].min = round_down(bbox.min);
+  m_nodes[index].max = round_up(bbox.max);
+
+  auto make_leaf = [&]() {
+    m_nodes[index].offset = uint32_t(m_indices.size());
+    m_nodes[index].count = count;
+    for (const Reference& ref : refs) m_indices.push_back(ref.index);
+    return index;
+  };
+
+  if (count <= m_config.min_leaf_size || depth + 1 >= max_depth) {
+    return make_leaf();
+  }
+
+  Split object = find_object_split(refs.data(), count, centroids);
+
+  // spatial splits only pay off where the children of the best object split overlap a lot
+  Split spatial;
+  if (m_spatial_budget > 0) {
+    AABB overlap(glm::max(object.left.min, object.right.min), glm::min(object.left.max, object.right.max));
+    bool overlapping = glm::all(glm::lessThan(object.left.min, object.right.max)) &&
+                       glm::all(glm::lessThan(object.right.min, object.left.max));
+    if (object.bin == 0 || (overlapping && overlap.area() > m_config.spatial_alpha * m_root_area)) {
+      spatial = find_spatial_split(refs, bbox);
+    }
+  }
+
+  std::vector<Reference> left, right;
+
+  if (spatial.bin != 0 && spatial.cost < object.cost) {
+    if (!worth_splitting(count, bbox, spatial.cost)) return make_leaf();
+    split_spatial(refs, spatial, left, right);
+  }
+
+  if (left.empty() || right.empty()) {
+    left.clear();
+    right.clear();
+
+    if (object.bin != 0) {
+      if (!worth_splitting(count, bbox, object.cost)) return make_leaf();
+      const size_t bin_count = std::clamp(m_config.bins, size_t(2), max_bins);
+      for (const Reference& ref : refs) {
+        bool is_left = object_bin(ref.centroid, centroids, object.axis, bin_count) < object.bin;
+        (is_left ? left : right).push_back(ref);
+      }
+    } else {
+      if (count <= m_config.max_leaf_size) return make_leaf();
+      uint32_t left_count = split_median(refs.data(), count, bbox.longest_axis());
+      left.assign(refs.begin(), refs.begin() + left_count);
+      right.assign(refs.begin() + left_count, refs.end());
+    }
+  }
+
+  // the references of this node are no longer needed while the children are built
+  refs = std::vector<Reference>();
+
+  construct_spatial(left, depth + 1);
+  uint32_t right_index = construct_spatial(right, depth + 1);
+
+  m_nodes[index].offset = right_index;
+  m_nodes[index].count = 0;
+  return index;
+}
+
+// bounds of the part of the referenced primitive that lies between the planes lo and hi on the axis
+AABB BVH::clip(const Reference& ref, size_t axis, double lo, double hi) const
+{
+  const Primitive& primitive = m_primitives[ref.index];
+  AABB result = empty_bounding_volume();
+
+  auto grow = [&result](const rvec3& p) {
+    result.min = glm::min(result.min, p);
+    result.max = glm::max(result.max, p);
+  };
+
+  if (primitive.type == Primitive::TRIANGLE) {
+    const rvec3 v[3] = {primitive.triangle.vertex(0), primitive.triangle.vertex(1), primitive.triangle.vertex(2)};
+    for (int i = 0; i < 3; i++) {
+      const rvec3& a = v[i];
+      const rvec3& b = v[(i + 1) % 3];
+
+      if (lo <= a[axis] && a[axis] <= hi) grow(a);
+
+      // points where the edge crosses the planes
+      for (real plane : {real(lo), real(hi)}) {
+        if ((a[axis] < plane && plane < b[axis]) || (b[axis] < plane && plane < a[axis])) {
+          rvec3 p = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+          p[axis] = plane;
+          grow(p);
+        }
+      }
+    }
+  } else {
+    result = ref.bbox;
+  }
+
+  // the reference may already have been clipped by an earlier split
+  result.min = glm::max(result.min, ref.bbox.min);
+  result.max = glm::min(result.max, ref.bbox.max);
+  result.min[axis] = std::max(result.min[axis], real(lo));
+  result.max[axis] = std::min(result.max[axis], real(hi));
+  return result;
+}
+
+BVH::Split BVH::find_spatial_split(const std::vector<Reference>& refs, const AABB& bbox) const
+{
+  struct Bin {
+    AABB bbox;
+    uint32_t entry, exit;
+  };
+
+  const size_t bin_count = std::clamp(m_config.bins, size_t(2), max_bins);
+  Split best;
+
+  for (size_t axis = 0; axis < 3; axis++) {
+    double extent = bbox.max[axis] - bbox.min[axis];
+    if (extent <= 0.0) continue;
+
+    double bin_width = extent / double(bin_count);
+    auto bin_of = [&](double x) {
+      return std::min(bin_count - 1, size_t(std::max(0.0, (x - bbox.min[axis]) / bin_width)));
+    };
+
+    std::array<Bin, max_bins> bins;
+    for (size_t b = 0; b < bin_count; b++) bins[b] = {empty_bounding_volume(), 0, 0};
+
+    // every reference adds its clipped bounds to all bins it overlaps, it enters in the first and exits in the last
+    for (const Reference& ref : refs) {
+      size_t first = bin_of(ref.bbox.min[axis]);
+      size_t last = bin_of(ref.bbox.max[axis]);
+
+      for (size_t b = first; b <= last; b++) {
+        double lo = bbox.min[axis] + double(b) * bin_width;
+        double hi = (b + 1 == bin_count) ? bbox.max[axis] : lo + bin_width;
+        AABB part = (first == last) ? ref.bbox : clip(ref, axis, lo, hi);
+        bins[b].bbox = merge(bins[b].bbox, part);
+      }
+
+      bins[first].entry++;
+      bins[last].exit++;
+    }
+
+    std::array<AABB, max_bins> right_bbox;
+    std::array<uint32_t, max_bins> right_count;
+    AABB right = empty_bounding_volume();
+    uint32_t exits = 0;
+    for (size_t b = bin_count - 1; b > 0; b--) {
+      right = merge(right, bins[b].bbox);
+      exits += bins[b].exit;
+      right_bbox[b] = right;
+      right_count[b] = exits;
+    }
+
+    AABB left = empty_bounding_volume();
+    uint32_t entries = 0;
+    for (size_t b = 1; b < bin_count; b++) {
+      left = merge(left, bins[b - 1].bbox);
+      entries += bins[b - 1].entry;
+      if (entries == 0 || right_count[b] == 0) continue;
+
+      double cost = left.area() * entries + right_bbox[b].area() * right_count[b];
+      if (cost < best.cost) {
+        best = {cost, axis, b, bbox.min[axis] + double(b) * bin_width, left, right_bbox[b]};
+      }
+    }
+  }
+
+  return best;
+}
+
+void BVH::split_spatial(const std::vector<Reference>& refs, const Split& split, std::vector<Reference>& left,
+                        std::vector<Reference>& right)
+{
+  constexpr double infinity = std::numeric_limits<double>::infinity();
+  const size_t axis = split.axis;
+
+  for (const Reference& ref : refs) {
+    if (ref.bbox.max[axis] <= split.position) {
+      left.push_back(ref);
+    } else if (split.position <= ref.bbox.min[axis]) {
+      right.push_back(ref);
+    } else if (m_spatial_budget == 0) {
+      // out of memory budget, keep the reference whole on the side of its centroid
+      (ref.centroid[axis] < split.position ? left : right).push_back(ref);
+    } else {
+      AABB lo = clip(ref, axis, -infinity, split.position);
+      AABB hi = clip(ref, axis, split.position, infinity);
+      left.push_back({lo, lo.center(), ref.index});
+      right.push_back({hi, hi.center(), ref.index});
+      m_spatial_budget--;
+    }
+  }
+}
+
+// The builders store the left child right after its parent and point to the right child, leaving unused
+// slots behind leaves. Copy the reachable nodes into a dense array in depth-first order, in which both
+// children of a node are stored next to each other. Traversal tests both children at once, and as nodes
+// are half a cache line, a pair then costs one cache line. The root is followed by an unused node so
+// that every pair starts at an even index. Returns the subtree at root, with node offsets relative to the
+// returned array.
+std::vector<BVH::Node, AlignedAllocator<BVH::Node>> BVH::compact(uint32_t root, size_t node_count) const
+{
+  std::vector<Node, AlignedAllocator<Node>> nodes(2);
+  nodes.reserve(node_count + 1);
+  nodes[1] = {glm::vec3(0.0f), 0, glm::vec3(0.0f), 0};
+
+  struct Entry {
+    uint32_t index;  // index in the sparse array
+    uint32_t dense;  // index in the dense array
+  };
+
+  std::vector<Entry> stack = {{root, 0}};
+
+  while (!stack.empty()) {
+    Entry entry = stack.back();
+    stack.pop_back();
+
+    const Node& node = m_nodes[entry.index];
+    nodes[entry.dense] = node;
+
+    if (!node.is_leaf()) {
+      uint32_t pair = uint32_t(nodes.size());
+      nodes.resize(pair + 2);
+      nodes[entry.dense].offset = pair;
+      stack.push_back({node.offset, pair + 1});
+      stack.push_back({entry.index + 1, pair});
+    }
+  }
+
+  return nodes;
+}
+
+// Give every range a lazy build left unbuilt a slice of nodes behind the top levels, large enough for any
+// tree over the range. The node array is never resized afterwards, so rays can traverse it while subtrees
+// are built into their slices.
+void BVH::reserve_subtrees()
+{
+  std::vector<Node, AlignedAllocator<Node>> nodes = compact(0, m_nodes.size());
+
+  struct Entry {
+    uint32_t index;
+    size_t depth;
+  };
+
+  std::vector<Entry> unbuilt;
+  std::vector<Entry> stack = {{0, 0}};
+
+  while (!stack.empty()) {
+    auto [index, depth] = stack.back();
+    stack.pop_back();
+    const Node& node = nodes[index];
+
+    if (node.is_unbuilt()) {
+      unbuilt.push_back({index, depth});
+    } else if (!node.is_leaf()) {
+      stack.push_back({node.offset + 1, depth + 1});
+      stack.push_back({node.offset, depth + 1});
+    }
+  }
+
+  m_subtree_count = unbuilt.size();
+  if (m_subtree_count == 0) return;
+  m_subtrees = std::make_unique<Subtree[]>(m_subtree_count);
+
+  // slices have an even size and start at an even index, so their node pairs do too
+  size_t size = nodes.size() + nodes.size() % 2;
+
+  for (uint32_t i = 0; i < m_subtree_count; i++) {
+    Node& node = nodes[unbuilt[i].index];
+    Subtree& subtree = m_subtrees[i];
+    subtree.begin = node.offset;
+    subtree.end = node.offset + (node.count & ~Node::unbuilt);
+    subtree.root = uint32_t(size);
+    subtree.depth = unbuilt[i].depth;
+    size += 2 * size_t(subtree.end - subtree.begin);
+
+    node.offset = i;
+    node.count = Node::unbuilt;
+  }
+
+  nodes.resize(size);
+  m_nodes = std::move(nodes);
+}
+
+// Build an unbuilt subtree of a lazy BVH, only the first ray reaching it does any work and all others wait
+// for it. Returns the index of the subtree root.
+uint32_t BVH::build_subtree(uint32_t index) const
+{
+  Subtree& subtree = m_subtrees[index];
+
+  if (!subtree.built.load(std::memory_order_acquire)) {
+    std::call_once(subtree.once, [this, &subtree]() {
+      // every subtree only writes its own slice of the nodes, references and index list
+      const_cast<BVH*>(this)->construct_subtree(subtree);
+      subtree.built.store(true, std::memory_order_release);
+    });
+  }
+
+  return subtree.root;
+}
+
+void BVH::construct_subtree(Subtree& subtree)
+{
+  // large subtrees are built with tasks of the rendering threads
+#pragma omp taskgroup
+  construct(subtree.begin, subtree.end, subtree.root, subtree.depth);
+
+  for (uint32_t i = subtree.begin; i < subtree.end; i++) m_indices[i] = m_references[i].index;
+
+  // the rest of the slice still holds nodes of the builder layout
+  const uint32_t slice_size = 2 * (subtree.end - subtree.begin);
+  auto nodes = compact(subtree.root, slice_size);
+  for (uint32_t i = 0; i < slice_size; i++) {
+    Node node = (i < nodes.size()) ? nodes[i] : Node{glm::vec3(0.0f), 0, glm::vec3(0.0f), 0};
+    if (!node.is_leaf()) node.offset += subtree.root;
+    m_nodes[subtree.root + i] = node;
+  }
+}
+
+// Reorder the node pairs into treelets. Starting from one pair, the pairs below it that are most likely
+// visited, estimated by the surface area of their parent, are stored next to each other until the treelet
+// holds treelet_size pairs. The pairs that did not fit start treelets of their own. Afterwards the leaf
+// index list is rewritten in the new leaf order.
+void BVH::layout_treelets()
+{
+  if (m_indices.empty() || m_nodes[0].is_leaf()) return;
+
+  std::vector<Node, AlignedAllocator<Node>> nodes = {m_nodes[0], m_nodes[1]};
+  nodes.reserve(m_nodes.size());
+
+  struct Pair {
+    uint32_t index;   // old index of the left child
+    uint32_t parent;  // new index of the parent
+    double area;      // surface area of the parent
+  };
+
+  auto smaller_area = [](const Pair& a, const Pair& b) { return a.area < b.area; };
+
+  std::vector<Pair> roots = {{m_nodes[0].offset, 0, node_area(m_nodes[0])}};
+  std::vector<Pair> candidates;
+
+  while (!roots.empty()) {
+    candidates.push_back(roots.back());
+    roots.pop_back();
+
+    for (size_t placed = 0; placed < m_config.treelet_size && !candidates.empty(); placed++) {
+      std::pop_heap(candidates.begin(), candidates.end(), smaller_area);
+      Pair pair = candidates.back();
+      candidates.pop_back();
+
+      uint32_t index = uint32_t(nodes.size());
+      nodes[pair.parent].offset = index;
+
+      for (uint32_t i = 0; i < 2; i++) {
+        const Node& child = m_nodes[pair.index + i];
+        nodes.push_back(child);
+        if (!child.is_leaf()) {
+          candidates.push_back({child.offset, index + i, node_area(child)});
+          std::push_heap(candidates.begin(), candidates.end(), smaller_area);
+        }
+      }
+    }
+
+    roots.insert(roots.end(), candidates.begin(), candidates.end());
+    candidates.clear();
+  }
+
+  m_nodes = std::move(nodes);
+  reorder_indices();
+}
+
+// rewrite the leaf index list in the order the leaves are stored
+void BVH::reorder_indices()
+{
+  std::vector<uint32_t> indices;
+  indices.reserve(m_indices.size());
+  for (Node& node : m_nodes) {
+    if (node.is_leaf()) {
+      uint32_t first = uint32_t(indices.size());
+      indices.insert(indices.end(), m_indices.begin() + node.offset, m_indices.begin() + node.offset + node.count);
+      node.offset = first;
+    }
+  }
+  m_indices = std::move(indices);
+}
+
+// Set associative LRU model of a 32 KB level 1 data cache with 64 byte lines.
+class CacheModel
+{
+ public:
+  uint64_t misses = 0;
+
+  CacheModel() { for (auto& set : m_sets) set.fill(UINT64_MAX); }
+
+  void access(const void* address, size_t size)
+  {
+    uint64_t first = reinterpret_cast<uintptr_t>(address) / line_size;
+    uint64_t last = (reinterpret_cast<uintptr_t>(address) + size - 1) / line_size;
+    for (uint64_t line = first; line <= last; line++) touch(line);
+  }
+
+ private:
+  static constexpr size_t line_size = 64, set_count = 64, ways = 8;
+  // lines of each set, most recently used first
+  std::array<std::array<uint64_t, ways>, set_count> m_sets;
+
+  void touch(uint64_t line)
+  {
+    auto& set = m_sets[line % set_count];
+    size_t way = 0;
+    while (way < ways - 1 && set[way] != line) way++;
+    if (set[way] != line) misses++;
+    for (; way > 0; way--) set[way] = set[way - 1];
+    set[0] = line;
+  }
+};
+
+// Simulated cache misses of closest hit traversals of random rays through the scene bounds, with a cache
+// that stays warm between rays. Nodes, index list and primitives all count.
+double BVH::cache_misses_per_ray(size_t ray_count) const
+{
+  if (m_primitives.empty()) return 0.0;
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<real> uniform(0.0, 1.0);
+  auto random_point = [&]() {
+    rvec3 r(uniform(rng), uniform(rng), uniform(rng));
+    return m_bounds.min + r * m_bounds.size();
+  };
+
+  CacheModel cache;
+  uint64_t visits = 0;
+
+  for (size_t i = 0; i < ray_count; i++) {
+    rvec3 origin = random_point(), target = random_point();
+    if (origin == target) continue;
+    closest_hit(Ray{origin, glm::normalize(target - origin)}, 1e9, visits, cache);
+  }
+
+  return double(cache.misses) / double(ray_count);
+}
+
+// Pointer based copy of the tree that subtrees can be moved around in, for the reinsertion optimizer.
+class ReinsertionTree
+{
+ public:
+  static constexpr uint32_t none = UINT32_MAX;
+
+  struct Node {
+    glm::vec3 min, max;
+    uint32_t parent, left, right;  // children are only used by interior nodes
+    uint32_t offset, count;        // leaf range in the index list, count is 0 for interior nodes
+    bool is_leaf() const { return count > 0; }
+  };
+
+  std::vector<Node> nodes;
+  uint32_t root = 0;
+
+  ReinsertionTree(const std::vector<BVH::Node, AlignedAllocator<BVH::Node>>& bvh) : nodes(bvh.size())
+  {
+    nodes[0].parent = none;
+    // node 1 only pads the pairs to even indices
+    for (uint32_t i = 0; i < bvh.size(); i++) {
+      if (i == 1) continue;
+      const BVH::Node& n = bvh[i];
+      Node& node = nodes[i];
+      node.min = n.min;
+      node.max = n.max;
+      node.offset = n.offset;
+      node.count = n.count;
+      if (!n.is_leaf()) {
+        node.left = n.offset;
+        node.right = n.offset + 1;
+        nodes[n.offset].parent = nodes[n.offset + 1].parent = i;
+      }
+    }
+  }
+
+  static double area(const glm::vec3& min, const glm::vec3& max)
+  {
+    glm::dvec3 d = glm::dvec3(max) - glm::dvec3(min);
+    return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  double area(uint32_t index) const { return area(nodes[index].min, nodes[index].max); }
+
+  // How much worse a node is than its children suggest, large for nodes that are much bigger than their
+  // children together (Bittner et al. 2013).
+  double inefficiency(uint32_t index) const
+  {
+    const Node& node = nodes[index];
+    double a = area(index), left = area(node.left), right = area(node.right);
+    double smallest = std::max(std::min(left, right), 1e-12 * a);
+    return a * (2.0 * a / std::max(left + right, 1e-12 * a)) * (a / smallest);
+  }
+
+  // Remove the subtree at index and its parent from the tree, the sibling takes the place of the parent.
+  // Returns the index of the parent, which is free afterwards.
+  uint32_t remove(uint32_t index)
+  {
+    uint32_t parent = nodes[index].parent;
+    uint32_t sibling = (nodes[parent].left == index) ? nodes[parent].right : nodes[parent].left;
+    uint32_t grandparent = nodes[parent].parent;
+
+    nodes[sibling].parent = grandparent;
+    if (grandparent == none) {
+      root = sibling;
+    } else {
+      replace_child(grandparent, parent, sibling);
+      refit(grandparent);
+    }
+    return parent;
+  }
+
+  // Insert the subtree at index as sibling of the node where it adds the least surface area to the tree,
+  // using the free node as their new parent.
+  void insert(uint32_t index, uint32_t free)
+  {
+    uint32_t sibling = find_sibling(index);
+    uint32_t parent = nodes[sibling].parent;
+
+    nodes[free].parent = parent;
+    nodes[free].left = sibling;
+    nodes[free].right = index;
+    nodes[free].count = 0;
+    nodes[sibling].parent = nodes[index].parent = free;
+
+    if (parent == none) {
+      root = free;
+    } else {
+      replace_child(parent, sibling, free);
+    }
+    refit(free);
+  }
+
+  size_t depth(uint32_t index) const
+  {
+    const Node& node = nodes[index];
+    return node.is_leaf() ? 0 : 1 + std::max(depth(node.left), depth(node.right));
+  }
+
+ private:
+
+  void replace_child(uint32_t parent, uint32_t child, uint32_t replacement)
+  {
+    if (nodes[parent].left == child) {
+      nodes[parent].left = replacement;
+    } else {
+      nodes[parent].right = replacement;
+    }
+  }
+
+  void refit(uint32_t index)
+  {
+    for (; index != none; index = nodes[index].parent) {
+      Node& node = nodes[index];
+      node.min = glm::min(nodes[node.left].min, nodes[node.right].min);
+      node.max = glm::max(nodes[node.left].max, nodes[node.right].max);
+    }
+  }
+
+  // Branch and bound search over the tree. Inserting next to a node adds the area of the new parent and
+  // the growth of all ancestors, the growth down to a node is a lower bound for all nodes below it.
+  uint32_t find_sibling(uint32_t index) const
+  {
+    const glm::vec3 min = nodes[index].min, max = nodes[index].max;
+    const double inserted_area = area(min, max);
+
+    struct Candidate {
+      double growth;  // area added to the ancestors of the node
+      uint32_t index;
+      bool operator<(const Candidate& other) const { return growth > other.growth; }
+    };
+
+    std::priority_queue<Candidate> queue;
+    queue.push({0.0, root});
+
+    uint32_t best = root;
+    double best_cost = std::numeric_limits<double>::infinity();
+
+    while (!queue.empty() && queue.top().growth + inserted_area < best_cost) {
+      Candidate candidate = queue.top();
+      queue.pop();
+
+      const Node& node = nodes[candidate.index];
+      double merged = area(glm::min(node.min, min), glm::max(node.max, max));
+      double cost = candidate.growth + merged;
+
+      if (cost < best_cost) {
+        best_cost = cost;
+        best = candidate.index;
+      }
+
+      double growth = cost - area(node.min, node.max);
+      if (!node.is_leaf() && growth + inserted_area < best_cost) {
+        queue.push({growth, node.left});
+        queue.push({growth, node.right});
+      }
+    }
+
+    return best;
+  }
+};
+
+// Improve the tree in place by moving subtrees to where they add less surface area. Each pass takes the
+// interior nodes that are largest compared to their children, removes them and inserts both of their
+// children again at the best position in the whole tree. Single reinsertions can make the tree worse, so
+// the tree after the best pass is kept and the SAH cost never rises. Passes run until they stop paying off
+// or the time budget is used up.
+void BVH::optimize()
+{
+  if (m_indices.empty() || m_nodes[0].is_leaf()) return;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  auto elapsed = [&start]() {
+    std::chrono::duration<double, std::milli> duration = std::chrono::high_resolution_clock::now() - start;
+    return duration.count();
+  };
+
+  const int threads = (m_config.threads > 0) ? m_config.threads : omp_get_max_threads();
+  const double initial_cost = sah_cost();
+
+  ReinsertionTree tree(m_nodes);
+  std::vector<uint32_t> interior;
+  std::vector<double> inefficiency(tree.nodes.size());
+  size_t reinsertions = 0, passes = 0;
+
+  // only the interior node areas change, the leaves stay as they are
+  auto total_area = [&]() {
+    double interior_area = 0.0;
+    for (uint32_t i : interior) interior_area += tree.area(i);
+    return interior_area;
+  };
+
+  for (uint32_t i = 0; i < tree.nodes.size(); i++) {
+    if (i != 1 && !tree.nodes[i].is_leaf()) interior.push_back(i);
+  }
+
+  // the leaves and the root box never change, so the interior area orders the trees like their SAH cost
+  double area = total_area();
+  double best_area = area;
+  ReinsertionTree best = tree;
+
+  // start with the worst percent of the nodes and take more of them once that stops paying off
+  size_t batch_size = std::max(size_t(1), interior.size() / 100);
+
+  while (elapsed() < m_config.optimize_time) {
+#pragma omp parallel for num_threads(threads)
+    for (int i = 0; i < int(interior.size()); i++) {
+      uint32_t index = interior[i];
+      inefficiency[index] = (index == tree.root) ? 0.0 : tree.inefficiency(index);
+    }
+
+    // the worst nodes, worst first
+    std::vector<uint32_t> batch = interior;
+    auto worse = [&inefficiency](uint32_t a, uint32_t b) { return inefficiency[a] > inefficiency[b]; };
+    std::nth_element(batch.begin(), batch.begin() + (batch_size - 1), batch.end(), worse);
+    batch.resize(batch_size);
+    std::sort(batch.begin(), batch.end(), worse);
+
+    for (uint32_t index : batch) {
+      if (elapsed() >= m_config.optimize_time) break;
+      // earlier reinsertions in this pass may have moved the node to the root
+      if (index == tree.root) continue;
+
+      uint32_t left = tree.nodes[index].left, right = tree.nodes[index].right;
+      uint32_t parent = tree.remove(index);
+      tree.insert(left, index);
+      tree.insert(right, parent);
+      reinsertions++;
+    }
+
+    double new_area = total_area();
+    passes++;
+
+    if (new_area < best_area) {
+      best_area = new_area;
+      best = tree;
+    }
+
+    if (new_area > 0.999 * area) {
+      if (batch_size == interior.size()) break;
+      batch_size = std::min(2 * batch_size, interior.size());
+    }
+    area = new_area;
+  }
+
+  if (area > best_area) tree = std::move(best);
+
+  // the traversal stacks only fit trees up to max_depth, keep the built tree if the optimized one is deeper
+  if (tree.depth(tree.root) + 2 > max_depth) {
+    std::cout << "BVH Optimization: tree too deep, keeping the built tree" << std::endl;
+    return;
+  }
+
+  std::vector<Node, AlignedAllocator<Node>> nodes(2);
+  nodes.reserve(m_nodes.size());
+  nodes[1] = {glm::vec3(0.0f), 0, glm::vec3(0.0f), 0};
+
+  struct Entry {
+    uint32_t index;  // index in the tree
+    uint32_t dense;  // index in the node array
+  };
+
+  std::vector<Entry> stack = {{tree.root, 0}};
+
+  while (!stack.empty()) {
+    Entry entry = stack.back();
+    stack.pop_back();
+
+    const ReinsertionTree::Node& node = tree.nodes[entry.index];
+    nodes[entry.dense] = {node.min, node.offset, node.max, node.count};
+
+    if (!node.is_leaf()) {
+      uint32_t pair = uint32_t(nodes.size());
+      nodes.resize(pair + 2);
+      nodes[entry.dense].offset = pair;
+      stack.push_back({node.right, pair + 1});
+      stack.push_back({node.left, pair});
+    }
+  }
+
+  m_nodes = std::move(nodes);
+  reorder_indices();
+
+  std::cout << "BVH Optimization: " << reinsertions << " reinsertions in " << passes << " passes, " << elapsed()
+            << " ms, SAH cost: " << initial_cost << " -> " << sah_cost() << std::endl;
+}
@@ -1,35 +1,209 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <vector>
 
 #include "aabb.h"
+#include "accelerator.h"
 #include "geometry.h"
+#include "util.h"
 
-class BVH
+struct BVHConfig {
+  enum Builder : uint8_t { MEDIAN, SAH, SBVH };
+  enum Layout : uint8_t { DEPTH_FIRST, TREELET };
+  Builder builder = SAH;
+  Layout layout = DEPTH_FIRST;     // order of the node pairs in memory
+  size_t treelet_size = 32;        // node pairs stored together by the treelet layout
+  size_t bins = 16;                // bins per axis of the binned SAH builder
+  double traversal_cost = 1.0;     // cost of visiting an interior node
+  double intersection_cost = 1.0;  // cost of intersecting a primitive
+  size_t min_leaf_size = 1;        // never split nodes with this many primitives or less
+  size_t max_leaf_size = 5;        // always split nodes with more primitives than this
+  int threads = 0;                 // build threads, 0 uses all available threads
+  size_t width = 2;                // branching factor used for rendering, 2 or 4
+  bool quantized = false;          // render with the compressed 4-wide BVH, ignores width
+  double spatial_alpha = 1e-5;     // SBVH: try spatial splits if object split children overlap more than this
+                                   // fraction of the scene surface area
+  double max_duplication = 0.5;    // SBVH: spatial splits add at most this many references per primitive
+  double rebuild_threshold = 1.5;  // rebuild instead of refitting once the SAH cost grew by this factor
+  double optimize_time = 0.0;      // milliseconds spent reinserting subtrees after the build, 0 skips it
+  bool lazy = false;               // build the top levels only, the rest when the first ray reaches it
+  size_t lazy_size = 1024;         // lazy: largest range of primitives left unbuilt, ignored by SBVH
+  bool meshlets = false;           // pack each leaf into a meshlet with quantized vertices instead of blocks,
+                                   // not used by lazy BVHs
+};
+
+struct BVHStatistics {
+  size_t node_count = 0;
+  size_t leaf_count = 0;
+  size_t reference_count = 0;               // leaf entries, larger than the primitive count with spatial splits
+  std::vector<size_t> depth_histogram;      // number of leaves at each depth
+  std::vector<size_t> leaf_size_histogram;  // number of leaves with each primitive count
+  double sah_cost = 0.0;
+  double overlap = 0.0;  // surface area of the overlap of all sibling boxes, relative to the root
+  size_t memory = 0;     // bytes used by nodes, primitives and index lists
+  double cache_misses = 0.0;  // simulated level 1 cache misses per random ray
+  size_t unbuilt_count = 0;   // subtrees of a lazy BVH that no ray reached yet
+};
+
+class BVH : public Accelerator
 {
  public:
+  // traversal stack size, the builder never creates deeper trees
+  static constexpr size_t max_depth = 64;
 
-  struct Node {
-    std::unique_ptr<Node> left, right;
-    AABB bbox;
-    std::vector<Primitive>::iterator begin, end;
-    bool is_leaf() const;
-    std::optional<Intersection> intersect(const Ray&);
-    std::optional<Intersection> intersect_primitives(const Ray&);
+  // 32 byte node with single precision bounds. Both children of an interior node are stored next to each
+  // other, `offset` points to the left one and the right one follows it. For leaves `offset` is the first
+  // entry in the primitive index list and `count` the number of primitives. Subtrees a lazy BVH did not
+  // build yet have the `unbuilt` count, with `offset` the index of the subtree.
+  struct alignas(32) Node {
+    static constexpr uint32_t unbuilt = 1u << 31;
+    glm::vec3 min;
+    uint32_t offset;
+    glm::vec3 max;
+    uint32_t count;
+    inline bool is_leaf() const { return count > 0; }
+    inline bool is_unbuilt() const { return count & unbuilt; }
+  };
+
+  static_assert(sizeof(Node) == 32);
+
+  // Four consecutive entries of the index list for the SIMD leaf test. Triangles are stored as single
+  // precision vertex and edges in structure of arrays form, spheres are only marked and tested one by one.
+  // A leaf tests the lanes of its range of the index list.
+  struct alignas(16) TriangleBlock {
+    float v0[3][4];
+    float e1[3][4];  // v1 - v0
+    float e2[3][4];  // v2 - v0
+    uint8_t scalar;  // lanes holding a sphere
   };
 
+  // Leaf packed into one contiguous cluster: this header, vertex_count vertices of three uint16_t cells in
+  // the grid given by origin and scale, and three 8 bit indices into these vertices per entry of the leaf.
+  // Vertices are shared by the triangles of the leaf. Spheres and triangles the grid is too coarse for have
+  // all three indices set to `exact` and are always tested exactly.
+  struct Meshlet {
+    static constexpr uint8_t exact = 255;
+    float origin[3];
+    float scale[3];
+    uint8_t vertex_count;
+  };
 
-  BVH(const std::vector<Primitive>&);
-  std::optional<Intersection> traverse(const Ray&);
-  Node* root() const { return m_root.get(); }
+  BVH(const std::vector<Primitive>&, const BVHConfig& config = BVHConfig());
+  // BVH over boxes without primitives, leaves reference the boxes through indices()
+  BVH(const std::vector<AABB>&, const BVHConfig& config = BVHConfig());
+  std::optional<Hit> traverse(const Ray&) const override;
+  // any hit traversal, returns at the first primitive closer than t_max
+  bool occluded(const Ray&, real t_max) const override;
+  void traverse_packet(const RayPacket&, std::optional<Hit>* hits) const override;
+  // versions that only add to the node visits instead of counting a ray, for traversing nested BVHs
+  std::optional<Hit> traverse(const Ray&, real t_max, uint64_t& visits) const;
+  bool occluded(const Ray&, real t_max, uint64_t& visits) const;
+  // closest and any hit tests of the primitives of a leaf, given by its range of the index list
+  std::optional<Hit> intersect_leaf(uint32_t first, uint32_t count, const Ray&, real t_max) const;
+  bool occlude_leaf(uint32_t first, uint32_t count, const Ray&, real t_max) const;
+  const AABB& bounds() const override { return m_bounds; }
+  size_t node_count() const { return m_nodes.size(); }
+  const std::vector<Node, AlignedAllocator<Node>>& nodes() const { return m_nodes; }
+  const std::vector<Primitive>& primitives() const { return m_primitives; }
+  // leaves reference primitives through this list, spatial splits may list a primitive more than once
+  const std::vector<uint32_t>& indices() const { return m_indices; }
+  // expected cost of a random ray according to the surface area heuristic
+  double sah_cost() const;
+  // Update the primitives and recompute all node bounds bottom-up, keeping the tree as it is. The
+  // primitives must be the ones the BVH was built from in the same order, only their geometry may change.
+  // Lazy BVHs cannot be refit.
+  void refit(const std::vector<Primitive>&);
+  // true once refitting made the tree so much worse than the built one that a rebuild pays off
+  bool degraded() const;
+  // true if every node bounds its children and the primitives of its leaves, checked after refitting
+  bool bounds_valid() const;
+  BVHStatistics statistics() const;
+  void print_statistics() const;
 
  private:
 
-  const size_t split_threshold = 5;
-  std::unique_ptr<Node> m_root;
+  static constexpr size_t max_bins = 64;
+
+  // primitive bounds used during construction
+  struct Reference {
+    AABB bbox;
+    rvec3 centroid;
+    uint32_t index;
+  };
+
+  // range of references a lazy build left for later, built into its own slice of the node array
+  struct Subtree {
+    std::once_flag once;
+    std::atomic<bool> built = false;
+    uint32_t begin, end;
+    uint32_t root;  // first node of the slice
+    size_t depth;
+  };
+
+  struct Split {
+    double cost = std::numeric_limits<double>::infinity();  // surface area weighted primitive count
+    size_t axis = 0;
+    size_t bin = 0;         // first bin right of the split plane, 0 if there is no valid split
+    double position = 0.0;  // split plane of spatial splits
+    AABB left, right;
+  };
+
+  const BVHConfig m_config;
+  AABB m_bounds;
+  std::vector<Node, AlignedAllocator<Node>> m_nodes;
   std::vector<Primitive> m_primitives;
+  std::vector<uint32_t> m_indices;
+  std::vector<uint32_t> m_sources;  // index of each primitive in the vector the BVH was built from
+  std::vector<Reference> m_references;
+  double m_build_cost = 0.0;
+  double m_cost = 0.0;
+  double m_root_area = 0.0;
+  size_t m_spatial_budget = 0;
+  size_t m_lazy_size = 0;  // construct leaves ranges up to this size unbuilt
+  std::unique_ptr<Subtree[]> m_subtrees;
+  size_t m_subtree_count = 0;
+  // index list packed in blocks of four, lazy BVHs have none and test their leaves one primitive at a time
+  std::vector<TriangleBlock, AlignedAllocator<TriangleBlock>> m_blocks;
+  // geometry of each entry of the index list for the exact leaf tests, the primitives are only read for the
+  // closest hit. Empty without blocks.
+  std::vector<PrimitiveGeometry> m_geometry;
+  // meshlets of all leaves padded to four bytes, replace the blocks and geometry when enabled
+  std::vector<uint8_t, AlignedAllocator<uint8_t>> m_meshlets;
+  // byte offset of the meshlet of the leaf starting at each entry of the index list, other entries are unused
+  std::vector<uint32_t> m_meshlet_offsets;
 
-  std::unique_ptr<Node> construct(const std::vector<Primitive>::iterator& begin, const std::vector<Primitive>::iterator& end);
-};
\ No newline at end of file
+  void build(int threads);
+  void construct(uint32_t begin, uint32_t end, uint32_t index, size_t depth);
+  void compute_bounds(const Reference* refs, uint32_t count, AABB& bbox, AABB& centroids) const;
+  uint32_t split_median(Reference* refs, uint32_t count, size_t axis);
+  Split find_object_split(const Reference* refs, uint32_t count, const AABB& centroids) const;
+  bool worth_splitting(uint32_t count, const AABB& bbox, double split_cost) const;
+  bool split_sah(Reference* refs, uint32_t count, const AABB& bbox, const AABB& centroids, uint32_t& left_count);
+  uint32_t construct_spatial(std::vector<Reference>& refs, size_t depth);
+  AABB clip(const Reference& ref, size_t axis, double lo, double hi) const;
+  Split find_spatial_split(const std::vector<Reference>& refs, const AABB& bbox) const;
+  void split_spatial(const std::vector<Reference>& refs, const Split& split, std::vector<Reference>& left,
+                     std::vector<Reference>& right);
+  std::vector<Node, AlignedAllocator<Node>> compact(uint32_t root, size_t node_count) const;
+  void reserve_subtrees();
+  uint32_t build_subtree(uint32_t index) const;
+  void construct_subtree(Subtree&);
+  void layout_treelets();
+  void reorder_indices();
+  void optimize();
+  void reorder_primitives();
+  void build_blocks();
+  void build_meshlets();
+  std::optional<Hit> intersect_meshlet(uint32_t first, uint32_t count, const Ray&, real t_max) const;
+  bool occlude_meshlet(uint32_t first, uint32_t count, const Ray&, real t_max) const;
+  AABB refit_node(uint32_t index, size_t depth);
+  double cache_misses_per_ray(size_t ray_count = 4096) const;
+  template <typename Observer>
+  std::optional<Hit> closest_hit(const Ray&, real t_max, uint64_t& visits, Observer&) const;
+};
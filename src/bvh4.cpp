@@ -0,0 +1,270 @@
+#include "bvh4.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PT_SSE 1
+#include <xmmintrin.h>
+#else
+#define PT_SSE 0
+#endif
+
+// empty child slots get inverted bounds, which the sign based slab test below never hits
+static constexpr float empty_min = std::numeric_limits<float>::infinity();
+static constexpr float empty_max = -std::numeric_limits<float>::infinity();
+
+// ray data shared by all box tests of one traversal
+struct RayBVH4 {
+  glm::vec3 origin;
+  glm::vec3 inv_direction;
+  // row of Node::bounds holding the near plane of each axis, the far plane is in row + 3 mod 6
+  int near[3], far[3];
+
+  RayBVH4(const Ray& r) : origin(r.origin), inv_direction(real(1) / r.direction)
+  {
+    for (int axis = 0; axis < 3; axis++) {
+      near[axis] = (inv_direction[axis] >= 0.0f) ? axis : axis + 3;
+      far[axis] = (inv_direction[axis] >= 0.0f) ? axis + 3 : axis;
+    }
+  }
+};
+
+// test the ray against the four child boxes, returns a bit mask of the children that were hit
+static int intersect_children(const BVH4::Node& node, const RayBVH4& r, float t_min, float t_max, float t_entry[4])
+{
+#if PT_SSE
+  __m128 t_near = _mm_set1_ps(t_min);
+  __m128 t_far = _mm_set1_ps(t_max);
+
+  for (int axis = 0; axis < 3; axis++) {
+    __m128 origin = _mm_set1_ps(r.origin[axis]);
+    __m128 inv_direction = _mm_set1_ps(r.inv_direction[axis]);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.near[axis]]), origin), inv_direction);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.far[axis]]), origin), inv_direction);
+    t_near = _mm_max_ps(t0, t_near);
+    t_far = _mm_min_ps(t1, t_far);
+  }
+
+  _mm_storeu_ps(t_entry, t_near);
+  return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+  int mask = 0;
+  for (int i = 0; i < 4; i++) {
+    float t_near = t_min, t_far = t_max;
+    for (int axis = 0; axis < 3; axis++) {
+      float t0 = (node.bounds[r.near[axis]][i] - r.origin[axis]) * r.inv_direction[axis];
+      float t1 = (node.bounds[r.far[axis]][i] - r.origin[axis]) * r.inv_direction[axis];
+      t_near = std::max(t0, t_near);
+      t_far = std::min(t1, t_far);
+    }
+    t_entry[i] = t_near;
+    if (t_near <= t_far) mask |= 1 << i;
+  }
+  return mask;
+#endif
+}
+
+BVH4::BVH4(const BVH& bvh) : m_bvh(bvh)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const auto& nodes = m_bvh.nodes();
+  m_nodes.reserve(nodes.size() / 2 + 1);
+
+  if (m_bvh.primitives().empty() || nodes[0].is_leaf()) {
+    // a single leaf still needs a node that holds its bounds
+    Node& root = m_nodes.emplace_back();
+    for (int axis = 0; axis < 3; axis++) {
+      std::fill_n(root.bounds[axis], 4, empty_min);
+      std::fill_n(root.bounds[axis + 3], 4, empty_max);
+    }
+    std::fill_n(root.child, 4, 0);
+    std::fill_n(root.count, 4, 0);
+
+    if (nodes[0].is_leaf()) {
+      for (int axis = 0; axis < 3; axis++) {
+        root.bounds[axis][0] = nodes[0].min[axis];
+        root.bounds[axis + 3][0] = nodes[0].max[axis];
+      }
+      root.child[0] = nodes[0].offset;
+      root.count[0] = nodes[0].count;
+    }
+  } else {
+    collapse(0);
+  }
+
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> duration = end - start;
+
+  // the index list is shared with the binary BVH
+  size_t primitives = std::max(m_bvh.primitives().size(), size_t(1));
+  size_t bytes = memory() + m_bvh.indices().size() * sizeof(uint32_t);
+  std::cout << "BVH4 Nodes: " << node_count() << ", Bytes/Primitive: " << double(bytes) / double(primitives)
+            << ", Collapse time: " << duration.count() << " ms" << std::endl;
+}
+
+static double area(const BVH::Node& node)
+{
+  glm::vec3 s = node.max - node.min;
+  return 2.0 * (s.x * s.y + s.y * s.z + s.z * s.x);
+}
+
+// Pull the grandchildren of the binary node up into one wide node. The interior child with the
+// largest surface area is opened first, as it is the one most likely to be hit.
+uint32_t BVH4::collapse(uint32_t binary_index)
+{
+  const auto& nodes = m_bvh.nodes();
+
+  uint32_t children[4] = {nodes[binary_index].offset, nodes[binary_index].offset + 1};
+  int child_count = 2;
+
+  while (child_count < 4) {
+    int best = -1;
+    double best_area = -1.0;
+    for (int i = 0; i < child_count; i++) {
+      const BVH::Node& child = nodes[children[i]];
+      if (!child.is_leaf() && area(child) > best_area) {
+        best = i;
+        best_area = area(child);
+      }
+    }
+    if (best < 0) break;
+
+    uint32_t opened = children[best];
+    children[best] = nodes[opened].offset;
+    children[child_count++] = nodes[opened].offset + 1;
+  }
+
+  uint32_t index = uint32_t(m_nodes.size());
+  m_nodes.emplace_back();
+
+  for (int i = 0; i < 4; i++) {
+    uint32_t child = 0, count = 0;
+
+    if (i < child_count) {
+      const BVH::Node& binary_child = nodes[children[i]];
+      if (binary_child.is_leaf()) {
+        child = binary_child.offset;
+        count = binary_child.count;
+      } else {
+        child = collapse(children[i]);
+      }
+    }
+
+    // collapse() grows m_nodes, so the node is looked up again after the recursion
+    Node& node = m_nodes[index];
+    for (int axis = 0; axis < 3; axis++) {
+      node.bounds[axis][i] = (i < child_count) ? nodes[children[i]].min[axis] : empty_min;
+      node.bounds[axis + 3][i] = (i < child_count) ? nodes[children[i]].max[axis] : empty_max;
+    }
+    node.child[i] = child;
+    node.count[i] = count;
+  }
+
+  return index;
+}
+
+std::optional<Hit> BVH4::traverse(const Ray& ray) const
+{
+  const RayBVH4 r(ray);
+
+  real t_max = 1e9;
+  float t_max_box = float(t_max);
+
+  std::optional<Hit> result = std::nullopt;
+
+  struct Entry {
+    uint32_t index;
+    uint32_t count;
+    float t_entry;
+  };
+
+  Entry stack[stack_size];
+  size_t stack_top = 0;
+  stack[stack_top++] = {0, 0, 0.0f};
+  uint64_t visits = 0;
+
+  while (stack_top > 0) {
+    Entry entry = stack[--stack_top];
+    if (entry.t_entry > t_max_box) continue;
+
+    if (entry.count > 0) {
+      // leaves are the ones of the binary BVH, so its leaf test can be used
+      auto hit = m_bvh.intersect_leaf(entry.index, entry.count, ray, t_max);
+      if (hit.has_value()) {
+        result = hit;
+        t_max = hit->t;
+      }
+      t_max_box = std::nextafter(float(t_max), std::numeric_limits<float>::max());
+      continue;
+    }
+
+    const Node& node = m_nodes[entry.index];
+    visits++;
+
+    float t_entry[4];
+    int mask = intersect_children(node, r, float(ray_epsilon), t_max_box, t_entry);
+
+    // push the hit children sorted by entry distance, so the nearest one is popped first
+    Entry hits[4];
+    int hit_count = 0;
+    for (int i = 0; i < 4; i++) {
+      if (mask & (1 << i)) {
+        Entry e = {node.child[i], node.count[i], t_entry[i]};
+        int j = hit_count++;
+        while (j > 0 && hits[j - 1].t_entry < e.t_entry) {
+          hits[j] = hits[j - 1];
+          j--;
+        }
+        hits[j] = e;
+      }
+    }
+
+    for (int i = 0; i < hit_count; i++) {
+      if (hits[i].count == 0) prefetch(&m_nodes[hits[i].index]);
+      stack[stack_top++] = hits[i];
+    }
+  }
+
+  count_ray(visits);
+  return result;
+}
+
+bool BVH4::occluded(const Ray& ray, real t_max) const
+{
+  const RayBVH4 r(ray);
+  const float t_max_box = std::nextafter(float(t_max), std::numeric_limits<float>::max());
+
+  uint32_t stack[stack_size];
+  size_t stack_top = 0;
+  stack[stack_top++] = 0;
+  uint64_t visits = 0;
+
+  while (stack_top > 0) {
+    const Node& node = m_nodes[stack[--stack_top]];
+    visits++;
+
+    float t_entry[4];
+    int mask = intersect_children(node, r, float(ray_epsilon), t_max_box, t_entry);
+
+    for (int i = 0; i < 4; i++) {
+      if (!(mask & (1 << i))) continue;
+
+      if (node.count[i] == 0) {
+        stack[stack_top++] = node.child[i];
+        continue;
+      }
+
+      if (m_bvh.occlude_leaf(node.child[i], node.count[i], ray, t_max)) {
+        count_ray(visits);
+        return true;
+      }
+    }
+  }
+
+  count_ray(visits);
+  return false;
+}
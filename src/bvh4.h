@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "accelerator.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "util.h"
+
+// 4-wide BVH collapsed from a binary BVH. The bounds of all four children are stored per node in
+// structure of arrays layout, so a ray is tested against all of them with one set of SSE instructions.
+// The primitives are shared with the binary BVH, which has to outlive this one.
+class BVH4 : public Accelerator
+{
+ public:
+
+  struct alignas(64) Node {
+    // bounds[0..2] are the min and bounds[3..5] the max x, y, z planes of the four children
+    float bounds[6][4];
+    // index of the child node or, for leaves, of the first primitive
+    uint32_t child[4];
+    // number of primitives in a leaf child, 0 for interior or empty children
+    uint32_t count[4];
+  };
+
+  static_assert(sizeof(Node) == 128);
+
+  BVH4(const BVH&);
+  std::optional<Hit> traverse(const Ray&) const override;
+  bool occluded(const Ray&, real t_max) const override;
+  const AABB& bounds() const override { return m_bvh.bounds(); }
+  size_t node_count() const { return m_nodes.size(); }
+  size_t memory() const { return m_nodes.capacity() * sizeof(Node); }
+
+ private:
+
+  // every visited node pushes at most 3 more entries than it pops
+  static constexpr size_t stack_size = 4 * BVH::max_depth;
+
+  const BVH& m_bvh;
+  std::vector<Node, AlignedAllocator<Node>> m_nodes;
+
+  uint32_t collapse(uint32_t binary_index);
+};
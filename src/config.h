@@ -6,3 +6,8 @@
 #define PT_INDIRECT_LIGHT_SAMPLING 1
 #define PT_IMPORTANCE_SAMPLE       1
 #define PT_CHECK_HEMISPHERE        1
+
+// geometry and traversal in double or single precision, set by the PT_DOUBLE_PRECISION build option
+#ifndef PT_DOUBLE_PRECISION
+#define PT_DOUBLE_PRECISION        1
+#endif
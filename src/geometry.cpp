@@ -1,8 +1,11 @@
 #include "geometry.h"
+#include <cmath>
 #include <cstdio>
 #include <iostream>
 #include <optional>
+#include <array>
 #include <atomic>
+#include <utility>
 #include <glm/glm.hpp>
 #include "util.h"
 #define GLM_ENABLE_EXPERIMENTAL
@@ -12,35 +15,37 @@
 
 #define ENABLE_COUNTER 1
 #if ENABLE_COUNTER
-std::atomic<uint64_t> intersection_test_counter = 0;
+// counters are kept per ray type, the ray type is set per thread by the renderer
+static thread_local size_t current_ray_type = size_t(RayType::CAMERA);
+std::array<std::atomic<uint64_t>, ray_type_count> intersection_test_counter = {};
+std::array<std::atomic<uint64_t>, ray_type_count> ray_counter = {};
+std::array<std::atomic<uint64_t>, ray_type_count> node_visit_counter = {};
 #endif
 
-glm::dvec3 Intersection::albedo() const
-{
-  if (material->texture) {
-    // image textures are generally sRGB, so we need to convert them to linear space
-    return reverse_gamma_correction(material->texture->sample(uv));
-  } else {
-    return material->albedo;
-  }
-}
-
-bool ray_vs_sphere(const Ray& r, const Sphere& s, const Interval<double>& ti, double& t)
+bool ray_vs_sphere(const Ray& r, const Sphere& s, const Interval<real>& ti, real& t)
 {
   auto oc = s.center - r.origin;
   auto a = glm::length2(r.direction);
   auto h = glm::dot(r.direction, oc);
   auto c = glm::length2(oc) - s.radius * s.radius;
 
-  auto discriminant = h * h - a * c;
+  // Haines et al. 2019, "Precision Improvements for Ray/Sphere Intersection", h^2 - a * c computed from the
+  // distance of the center to the line cancels far less in single precision
+  auto l = oc - (h / a) * r.direction;
+  auto discriminant = a * (s.radius * s.radius - glm::length2(l));
   if (discriminant < 0) return false;
 
   auto sqrtd = std::sqrt(discriminant);
 
-  // Find the nearest root that lies in the acceptable range.
-  auto root = (h - sqrtd) / a;
+  // Find the nearest root that lies in the acceptable range. The root further from zero is computed without
+  // cancellation, the other one from the product of the roots c / a.
+  auto q = h + std::copysign(sqrtd, h);
+  auto near = q / a, far = c / q;
+  if (near > far) std::swap(near, far);
+
+  auto root = near;
   if (!ti.surrounds(root)) {
-    root = (h + sqrtd) / a;
+    root = far;
     if (!ti.surrounds(root)) return false;
   }
 
@@ -48,177 +53,244 @@ bool ray_vs_sphere(const Ray& r, const Sphere& s, const Interval<double>& ti, do
   return true;
 }
 
-bool Sphere::intersect(const Ray& r, const Interval<double>& ti, double& t) const
+bool Sphere::intersect(const Ray& r, const Interval<real>& ti, real& t) const
 {
   return ray_vs_sphere(r, *this, ti, t);
 }
 
-glm::dvec2 Sphere::texcoord(const glm::dvec3& point_on_sphere) const
+rvec2 Sphere::texcoord(const rvec3& point_on_sphere) const
 {
-  glm::dvec3 p = glm::normalize(point_on_sphere - center);
-  double theta = std::acos(-p.y);
-  double phi = std::atan2(-p.z, p.x) + pi;
-  double u = phi / (2 * pi);
-  double v = theta / pi;
+  rvec3 p = glm::normalize(point_on_sphere - center);
+  real theta = std::acos(-p.y);
+  real phi = std::atan2(-p.z, p.x) + pi;
+  real u = phi / (2 * pi);
+  real v = theta / pi;
   return {u, v};
 }
 
-bool Triangle::intersect(const Ray& r, const Interval<double>& ti, double& t) const
+size_t Mesh::memory() const
 {
-  return ray_vs_triangle(r, *this, ti, t);
+  return positions.capacity() * sizeof(rvec3) + normals.capacity() * sizeof(rvec3) +
+         texcoords.capacity() * sizeof(rvec2) + indices.capacity() * sizeof(Index) + edges.capacity() * sizeof(rvec3);
 }
 
-static void barycentric(const glm::dvec3& a, const glm::dvec3& b, const glm::dvec3& c, const glm::dvec3& p, double& u,
-                        double& v, double& w)
+void Mesh::compute_edges()
 {
-  glm::dvec3 v0 = b - a, v1 = c - a, v2 = p - a;
-  double d00 = glm::dot(v0, v0);
-  double d01 = glm::dot(v0, v1);
-  double d11 = glm::dot(v1, v1);
-  double d20 = glm::dot(v2, v0);
-  double d21 = glm::dot(v2, v1);
-  double inv_denom = 1.0 / (d00 * d11 - d01 * d01);
-  v = (d11 * d20 - d01 * d21) * inv_denom;
-  w = (d00 * d21 - d01 * d20) * inv_denom;
-  u = 1.0 - v - w;
+  edges.resize(2 * face_count());
+  for (uint32_t face = 0; face < face_count(); face++) compute_edges(face);
 }
 
-glm::dvec2 Triangle::texcoord(const glm::dvec3& point_on_triangle) const
+void Mesh::compute_edges(uint32_t face)
 {
-  double u, v, w;
-  barycentric(v0, v1, v2, point_on_triangle, u, v, w);
-  return u * t0 + v * t1 + w * t2;
+  const rvec3& v0 = positions[indices[3 * face].position];
+  edges[2 * face] = positions[indices[3 * face + 1].position] - v0;
+  edges[2 * face + 1] = positions[indices[3 * face + 2].position] - v0;
 }
 
-glm::dvec3 Triangle::normal() const
+bool Triangle::intersect(const Ray& r, const Interval<real>& ti, real& t, rvec2& barycentrics) const
 {
-  glm::dvec3 v0v1 = v1 - v0;
-  glm::dvec3 v0v2 = v2 - v0;
-  return glm::normalize(glm::cross(v0v1, v0v2));
+  return ray_vs_triangle(r, vertex(0), edge(0), edge(1), ti, t, barycentrics);
 }
 
-glm::dvec3 Triangle::normal(const glm::dvec3& point_on_triangle) const
+static void barycentric(const rvec3& a, const rvec3& b, const rvec3& c, const rvec3& p, real& u,
+                        real& v, real& w)
 {
-  double u, v, w;
-  barycentric(v0, v1, v2, point_on_triangle, u, v, w);
-  return u * n0 + v * n1 + w * n2;
+  rvec3 v0 = b - a, v1 = c - a, v2 = p - a;
+  real d00 = glm::dot(v0, v0);
+  real d01 = glm::dot(v0, v1);
+  real d11 = glm::dot(v1, v1);
+  real d20 = glm::dot(v2, v0);
+  real d21 = glm::dot(v2, v1);
+  real inv_denom = 1.0 / (d00 * d11 - d01 * d01);
+  v = (d11 * d20 - d01 * d21) * inv_denom;
+  w = (d00 * d21 - d01 * d20) * inv_denom;
+  u = 1.0 - v - w;
 }
 
-// https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/ray-triangle-intersection-geometric-solution.html
-bool ray_vs_triangle(const Ray& r, const Triangle& tri, const Interval<double>& ti, double& t)
+rvec2 Triangle::texcoord(const rvec2& barycentrics) const
 {
-  // Compute the plane's normal
-  glm::dvec3 v0v1 = tri.v1 - tri.v0;
-  glm::dvec3 v0v2 = tri.v2 - tri.v0;
-
-  // No need to normalize
-  glm::dvec3 N = glm::cross(v0v1, v0v2);  // N
-
-  // Step 1: Finding P
+  const auto& t = mesh->texcoords;
+  return (real(1) - barycentrics.x - barycentrics.y) * t[index(0).texcoord] +
+         barycentrics.x * t[index(1).texcoord] + barycentrics.y * t[index(2).texcoord];
+}
 
-  // Check if the ray and plane are parallel
-  double NdotRayDirection = glm::dot(N, r.direction);
-  if (glm::abs(NdotRayDirection) < ti.min)  // Almost 0
-    return false;                           // They are parallel, so they don't intersect!
+rvec3 Triangle::normal(const rvec2& barycentrics) const
+{
+  const auto& n = mesh->normals;
+  return (real(1) - barycentrics.x - barycentrics.y) * n[index(0).normal] + barycentrics.x * n[index(1).normal] +
+         barycentrics.y * n[index(2).normal];
+}
 
-  // Compute d parameter using equation 2
-  float d = -glm::dot(N, tri.v0);
+rvec3 Triangle::normal() const
+{
+  return glm::normalize(glm::cross(edge(0), edge(1)));
+}
 
-  // Compute t (equation 3)
-  t = -(glm::dot(N, r.origin) + d) / NdotRayDirection;
+rvec3 Triangle::normal(const rvec3& point_on_triangle) const
+{
+  real u, v, w;
+  barycentric(vertex(0), vertex(1), vertex(2), point_on_triangle, u, v, w);
+  const auto& n = mesh->normals;
+  return u * n[index(0).normal] + v * n[index(1).normal] + w * n[index(2).normal];
+}
 
-  // Check if the triangle is behind the ray
-  if (t < ti.min) return false;  // The triangle is behind
+// Moller-Trumbore with the edges precomputed, https://www.graphics.cornell.edu/pubs/1997/MT97.pdf
+// The barycentric coordinates are computed from the edges instead of the hit point, so points on a shared
+// edge are inside at least one of the two triangles up to rounding in the last bits.
+bool ray_vs_triangle(const Ray& r, const rvec3& v0, const rvec3& e1, const rvec3& e2,
+                     const Interval<real>& ti, real& t, rvec2& barycentrics)
+{
+  rvec3 p = glm::cross(r.direction, e2);
+  real det = glm::dot(e1, p);
 
-  // Compute the intersection point using equation 1
-  glm::dvec3 P = r.point_at(t);
+  // the ray is parallel to the plane or the triangle is degenerate
+  if (det == real(0)) return false;
 
-  // Step 2: Inside-Outside Test
-  glm::dvec3 Ne;  // Vector perpendicular to triangle's plane
+  real inv_det = real(1) / det;
+  rvec3 s = r.origin - v0;
+  real u = glm::dot(s, p) * inv_det;
+  if (u < real(0) || u > real(1)) return false;
 
-  // Test sidedness of P w.r.t. edge v0v1
-  glm::dvec3 v0p = P - tri.v0;
-  Ne = glm::cross(v0v1, v0p);
-  if (glm::dot(N, Ne) < 0) return false;  // P is on the right side
+  rvec3 q = glm::cross(s, e1);
+  real v = glm::dot(r.direction, q) * inv_det;
+  if (v < real(0) || u + v > real(1)) return false;
 
-  // Test sidedness of P w.r.t. edge v2v1
-  glm::dvec3 v2v1 = tri.v2 - tri.v1;
-  glm::dvec3 v1p = P - tri.v1;
-  Ne = glm::cross(v2v1, v1p);
-  if (glm::dot(N, Ne) < 0) return false;  // P is on the right side
+  t = glm::dot(e2, q) * inv_det;
+  if (t < ti.min || ti.max < t) return false;
 
-  // Test sidedness of P w.r.t. edge v2v0
-  glm::dvec3 v2v0 = tri.v0 - tri.v2;
-  glm::dvec3 v2p = P - tri.v2;
-  Ne = glm::cross(v2v0, v2p);
-  if (glm::dot(N, Ne) < 0) return false;  // P is on the right side
+  barycentrics = {u, v};
+  return true;
+}
 
-  return true;  // The ray hits the triangle
+std::optional<Hit> Primitive::intersect(const Ray& ray, real t_max) const
+{
+  Hit hit;
+  if (!intersect(ray, t_max, hit.t, hit.barycentrics)) return std::nullopt;
+  hit.primitive = this;
+  return hit;
 }
 
-std::optional<Intersection> Primitive::intersect(const Ray& ray) const
+bool Primitive::intersect(const Ray& ray, real t_max, real& t, rvec2& barycentrics) const
 {
 #if ENABLE_COUNTER
-  intersection_test_counter++;
+  intersection_test_counter[current_ray_type]++;
 #endif
-  double t;
-  Interval<double> ti(0.00001, 1e9);
+  Interval<real> ti(ray_epsilon, t_max);
   switch (type) {
-    case SPHERE: {
-      if (sphere.intersect(ray, ti, t)) {
-        Intersection surface;
-        surface.id = id;
-        surface.t = t;
-        surface.point = ray.point_at(t);
-        glm::dvec3 normal = (surface.point - sphere.center) / sphere.radius;
-        if (glm::dot(ray.direction, normal) > 0.0) {
-          // ray is inside the sphere
-          surface.normal = -normal;
-          surface.inside = false;
-        } else {
-          // ray is outside the sphere
-          surface.normal = normal;
-          surface.inside = true;
-        }
-        surface.material = material;
-        if (surface.material->texture) {
-          surface.uv = sphere.texcoord(surface.point);
-        }
-        return surface;
-      } else {
-        return std::nullopt;
-      }
+    case SPHERE:
+      return sphere.intersect(ray, ti, t);
+    case TRIANGLE:
+      return triangle.intersect(ray, ti, t, barycentrics);
+    default:
+      return false;
+  }
+}
+
+Intersection Primitive::surface(const Ray& ray, real t, const rvec2& barycentrics) const
+{
+  Intersection surface;
+  surface.id = id;
+  surface.t = t;
+  const rvec3 point = ray.point_at(t);
+  surface.point = point;
+  surface.material = material;
+
+  if (type == SPHERE) {
+    rvec3 normal = (point - sphere.center) / sphere.radius;
+    surface.geometric_normal = normal;
+    if (glm::dot(ray.direction, normal) > 0.0) {
+      // ray is inside the sphere
+      surface.normal = -normal;
+      surface.inside = false;
+    } else {
+      // ray is outside the sphere
+      surface.normal = normal;
+      surface.inside = true;
+    }
+    if (surface.material->texture) {
+      surface.uv = sphere.texcoord(point);
     }
-    case TRIANGLE: {
-      if (triangle.intersect(ray, ti, t)) {
-        Intersection surface;
-        surface.id = id;
-        surface.t = t;
-        surface.point = ray.point_at(t);
-        glm::dvec3 normal = triangle.normal(surface.point);
-        if (is_light()) {
-          surface.normal = normal;
-          surface.inside = true;
-        } else {
-          if (glm::dot(ray.direction, normal) > 0.0) {
-            surface.normal = -normal;
-            surface.inside = false;
-          } else {
-            surface.normal = normal;
-            surface.inside = true;
-          }
-        }
-        surface.material = material;
-        if (surface.material->texture) {
-          surface.uv = triangle.texcoord(surface.point);
-        }
-        return surface;
+  } else {
+    rvec3 normal = triangle.normal(barycentrics);
+    surface.geometric_normal = triangle.normal();
+    if (is_light()) {
+      surface.normal = normal;
+      surface.inside = true;
+    } else {
+      if (glm::dot(ray.direction, normal) > 0.0) {
+        surface.normal = -normal;
+        surface.inside = false;
       } else {
-        return std::nullopt;
+        surface.normal = normal;
+        surface.inside = true;
       }
     }
+    if (surface.material->texture) {
+      surface.uv = triangle.texcoord(barycentrics);
+    }
+  }
+
+  if (material->texture) {
+    // image textures are generally sRGB, so we need to convert them to linear space
+    surface.albedo = reverse_gamma_correction(material->texture->sample(surface.uv));
+  } else {
+    surface.albedo = material->albedo;
+  }
+
+  return surface;
+}
+
+bool Primitive::occludes(const Ray& ray, real t_max) const
+{
+#if ENABLE_COUNTER
+  intersection_test_counter[current_ray_type]++;
+#endif
+  real t;
+  rvec2 barycentrics;
+  Interval<real> ti(ray_epsilon, t_max);
+  switch (type) {
+    case SPHERE:
+      return sphere.intersect(ray, ti, t);
+    case TRIANGLE:
+      return triangle.intersect(ray, ti, t, barycentrics);
     default:
-      return std::nullopt;
+      return false;
+  }
+}
+
+PrimitiveGeometry::PrimitiveGeometry(const Primitive& primitive) : type(primitive.type)
+{
+  if (type == Primitive::SPHERE) {
+    sphere = primitive.sphere;
+  } else {
+    const Triangle& t = primitive.triangle;
+    triangle = {t.vertex(0), t.edge(0), t.edge(1)};
+  }
+}
+
+bool PrimitiveGeometry::intersect(const Ray& ray, real t_max, real& t, rvec2& barycentrics) const
+{
+#if ENABLE_COUNTER
+  intersection_test_counter[current_ray_type]++;
+#endif
+  Interval<real> ti(ray_epsilon, t_max);
+  if (type == Primitive::SPHERE) return sphere.intersect(ray, ti, t);
+  return ray_vs_triangle(ray, triangle.v0, triangle.e1, triangle.e2, ti, t, barycentrics);
+}
+
+bool PrimitiveGeometry::occludes(const Ray& ray, real t_max) const
+{
+  real t;
+  rvec2 barycentrics;
+  return intersect(ray, t_max, t, barycentrics);
+}
+
+rvec3 Primitive::normal(const rvec3& point) const
+{
+  if (type == Type::TRIANGLE) {
+    return triangle.normal(point);
+  } else {
+    return (point - sphere.center) / sphere.radius;
   }
 }
 
@@ -233,10 +305,11 @@ glm::dvec3 Primitive::sample_point(const glm::dvec3& point) const
     double u = 1.0 - t;
     double v = r2 * t;
     double w = 1.0 - u - v;
-    return u * triangle.v0 + v * triangle.v1 + w * triangle.v2;
+    return u * glm::dvec3(triangle.vertex(0)) + v * glm::dvec3(triangle.vertex(1)) + w * glm::dvec3(triangle.vertex(2));
   } else {
-    auto normal = glm::normalize(point - sphere.center);
-    return sphere.center + (random_on_hemisphere(normal) * sphere.radius);
+    glm::dvec3 center = sphere.center;
+    auto normal = glm::normalize(point - center);
+    return center + (random_on_hemisphere(normal) * double(sphere.radius));
   }
 }
 
@@ -244,12 +317,12 @@ glm::dvec3 Primitive::sample_point(const glm::dvec3& point) const
 double Primitive::sample_area() const
 {
   if (type == Type::TRIANGLE) {
-    glm::dvec3 v0v1 = triangle.v1 - triangle.v0;
-    glm::dvec3 v0v2 = triangle.v2 - triangle.v0;
+    glm::dvec3 v0v1 = triangle.vertex(1) - triangle.vertex(0);
+    glm::dvec3 v0v2 = triangle.vertex(2) - triangle.vertex(0);
     return 0.5 * glm::length(glm::cross(v0v1, v0v2));
   } else {
     // we actually sample only the hemisphere that is towards us
-    return (4.0 * pi * sq(sphere.radius)) / 2.0;
+    return (4.0 * pi * sq(double(sphere.radius))) / 2.0;
   }
 }
 
@@ -270,9 +343,66 @@ std::optional<Intersection> closest(const std::optional<Intersection>& a, const
   return std::nullopt;
 }
 
-void print_stats()
+void set_ray_type(RayType type)
 {
 #if ENABLE_COUNTER
-  std::cout << "Intersection Test Count: " << intersection_test_counter.load() << std::endl;
+  current_ray_type = size_t(type);
+#endif
+}
+
+void count_ray(uint64_t node_visits)
+{
+#if ENABLE_COUNTER
+  ray_counter[current_ray_type]++;
+  node_visit_counter[current_ray_type] += node_visits;
+#endif
+}
+
+void count_intersection_tests(uint64_t count)
+{
+#if ENABLE_COUNTER
+  intersection_test_counter[current_ray_type] += count;
+#endif
+}
+
+RayStatistics ray_statistics(RayType type)
+{
+  RayStatistics stats = {0, 0, 0};
+#if ENABLE_COUNTER
+  stats.rays = ray_counter[size_t(type)].load();
+  stats.node_visits = node_visit_counter[size_t(type)].load();
+  stats.intersection_tests = intersection_test_counter[size_t(type)].load();
+#endif
+  return stats;
+}
+
+void print_stats(double seconds)
+{
+#if ENABLE_COUNTER
+  const char* names[ray_type_count] = {"Camera", "Indirect", "Shadow"};
+  RayStatistics total = {0, 0, 0};
+
+  for (size_t i = 0; i < ray_type_count; i++) {
+    RayStatistics stats = ray_statistics(RayType(i));
+    total.rays += stats.rays;
+    total.node_visits += stats.node_visits;
+    total.intersection_tests += stats.intersection_tests;
+
+    if (stats.rays > 0) {
+      std::cout << names[i] << " Rays: " << stats.rays
+                << ", Node Visits/Ray: " << double(stats.node_visits) / double(stats.rays)
+                << ", Intersection Tests/Ray: " << double(stats.intersection_tests) / double(stats.rays) << std::endl;
+    }
+  }
+
+  std::cout << "Intersection Test Count: " << total.intersection_tests << std::endl;
+  std::cout << "Ray Count: " << total.rays << std::endl;
+  std::cout << "Node Visit Count: " << total.node_visits << std::endl;
+  if (total.rays > 0) {
+    std::cout << "Node Visits/Ray: " << double(total.node_visits) / double(total.rays) << std::endl;
+  }
+  if (seconds > 0.0) {
+    std::cout << "Rays/Second: " << double(total.rays) / seconds << std::endl;
+  }
 #endif
 }
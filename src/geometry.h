@@ -11,45 +11,88 @@
 #include <memory>
 #include <vector>
 
+// closest distance along a ray that counts as a hit, avoids self intersections
+constexpr double ray_epsilon = 0.00001;
+
 struct Intersection {
   uint32_t id;
   double t;
   glm::dvec3 point;
   glm::dvec3 normal;
+  glm::dvec3 geometric_normal;  // face normal without interpolation or flipping, for moving ray origins off the surface
   glm::dvec2 uv;
   Material* material;
+  glm::dvec3 albedo;  // material albedo or texture sample at uv, looked up once per hit
   bool inside;
   inline bool is_closer_than(const Intersection& other) const { return t < other.t; }
-  glm::dvec3 albedo() const;
+};
+
+struct Primitive;
+
+// Closest hit found by a traversal, without the surface attributes. Scene::resolve_hit computes those once
+// for the closest hit instead of for every primitive hit on the way.
+struct Hit {
+  static constexpr uint32_t no_instance = UINT32_MAX;
+  real t;
+  rvec2 barycentrics;               // weights of v1 and v2 for triangles
+  const Primitive* primitive;       // owned by the accelerator that found the hit
+  uint32_t instance = no_instance;  // TLAS instance the primitive was hit in, in object space
 };
 
 std::optional<Intersection> closest(const std::optional<Intersection>& a, const std::optional<Intersection>& b);
 
 struct Sphere {
-  glm::dvec3 center;
-  double radius;
+  rvec3 center;
+  real radius;
   Sphere() : center(0, 0, 0), radius(1) {}
-  Sphere(const glm::dvec3& c, double r) : center(c), radius(r) {}
-  glm::dvec2 texcoord(const glm::dvec3& point_on_sphere) const;
-  bool intersect(const Ray& r, const Interval<double>& ti, double& t) const;
+  Sphere(const rvec3& c, real r) : center(c), radius(r) {}
+  rvec2 texcoord(const rvec3& point_on_sphere) const;
+  bool intersect(const Ray& r, const Interval<real>& ti, real& t) const;
 };
 
-// vertex order is counter-clockwise
+// Triangles sharing their vertex attributes the way an OBJ file stores them. Every face corner indexes the
+// positions, normals and texture coordinates separately, so a position shared by six faces is stored once.
+struct Mesh {
+  struct Index {
+    uint32_t position, normal, texcoord;
+  };
+  std::vector<rvec3> positions;
+  std::vector<rvec3> normals;    // corners without a normal index a zero normal
+  std::vector<rvec2> texcoords;  // corners without a texture coordinate index (0, 0)
+  std::vector<Index> indices;    // three per face, counter-clockwise
+  std::vector<rvec3> edges;      // two per face, vertex 1 and vertex 2 minus vertex 0
+  size_t face_count() const { return indices.size() / 3; }
+  // recompute the edges of every face or of one face, after its positions moved
+  void compute_edges();
+  void compute_edges(uint32_t face);
+  // bytes of the attribute and index arrays
+  size_t memory() const;
+};
+
+// face of a mesh, the mesh is owned by the scene and has to outlive the triangle
 struct Triangle {
-  glm::dvec3 v0, v1, v2;  // vertex position
-  glm::dvec3 n0, n1, n2;  // normal
-  glm::dvec2 t0, t1, t2;  // texture coordinate
+  const Mesh* mesh;
+  uint32_t face;
   Triangle() {}
-  glm::dvec2 texcoord(const glm::dvec3& point_on_triangle) const;
+  Triangle(const Mesh* m, uint32_t f) : mesh(m), face(f) {}
+  const Mesh::Index& index(int corner) const { return mesh->indices[3 * face + corner]; }
+  const rvec3& vertex(int corner) const { return mesh->positions[index(corner).position]; }
+  const rvec3& edge(int i) const { return mesh->edges[2 * face + i]; }
+  // interpolated from the barycentric coordinates of vertices 1 and 2
+  rvec2 texcoord(const rvec2& barycentrics) const;
   // interpolated normal
-  glm::dvec3 normal(const glm::dvec3& point_on_triangle) const;
+  rvec3 normal(const rvec3& point_on_triangle) const;
+  rvec3 normal(const rvec2& barycentrics) const;
   // flat normal
-  glm::dvec3 normal() const;
-  bool intersect(const Ray& r, const Interval<double>& ti, double& t) const;
+  rvec3 normal() const;
+  bool intersect(const Ray& r, const Interval<real>& ti, real& t, rvec2& barycentrics) const;
 };
 
-bool ray_vs_sphere(const Ray&, const Sphere&, const Interval<double>& ti, double& t);
-bool ray_vs_triangle(const Ray&, const Triangle&, const Interval<double>& ti, double& t);
+bool ray_vs_sphere(const Ray&, const Sphere&, const Interval<real>& ti, real& t);
+// triangle given by the vertex v0 and the edges e1 = v1 - v0, e2 = v2 - v0, barycentrics are the weights of
+// v1 and v2 at the hit point
+bool ray_vs_triangle(const Ray&, const rvec3& v0, const rvec3& e1, const rvec3& e2,
+                     const Interval<real>& ti, real& t, rvec2& barycentrics);
 
 struct Primitive {
   enum Type : uint8_t { SPHERE, TRIANGLE };
@@ -64,10 +107,52 @@ struct Primitive {
 
   Primitive(const Sphere& s, Material* m) : type(SPHERE), sphere(s), material(m), bbox(AABB(s)) {}
   Primitive(const Triangle& t, Material* m) : type(TRIANGLE), triangle(t), material(m), bbox(AABB(t)) {}
-  std::optional<Intersection> intersect(const Ray&) const;
+  std::optional<Hit> intersect(const Ray&, real t_max = 1e9) const;
+  // distance of the closest hit before t_max and its barycentric coordinates, without the surface attributes
+  bool intersect(const Ray&, real t_max, real& t, rvec2& barycentrics) const;
+  // surface attributes of the hit at distance t
+  Intersection surface(const Ray&, real t, const rvec2& barycentrics) const;
+  // true if the ray hits the primitive closer than t_max, cheaper than intersect()
+  bool occludes(const Ray&, real t_max) const;
+  // geometric normal at a point on the primitive, interpolated for triangles
+  rvec3 normal(const rvec3& point) const;
   bool is_light() const;
   glm::dvec3 sample_point(const glm::dvec3 &) const;
   double sample_area() const;
 };
 
-void print_stats();
+// The part of a primitive read by intersection tests, without the normals, texture coordinates and material
+// that only the closest hit needs. Triangles store their vertex and edges instead of indexing the mesh, so
+// accelerators can keep a dense copy next to their leaves and read the full primitive once per ray.
+struct PrimitiveGeometry {
+  Primitive::Type type;
+  union {
+    Sphere sphere;
+    struct {
+      rvec3 v0, e1, e2;
+    } triangle;
+  };
+
+  explicit PrimitiveGeometry(const Primitive&);
+  // same results as the tests of the primitive
+  bool intersect(const Ray&, real t_max, real& t, rvec2& barycentrics) const;
+  bool occludes(const Ray&, real t_max) const;
+};
+
+enum class RayType : uint8_t { CAMERA, INDIRECT, SHADOW };
+constexpr size_t ray_type_count = 3;
+
+struct RayStatistics {
+  uint64_t rays;
+  uint64_t node_visits;
+  uint64_t intersection_tests;
+};
+
+// attribute the following rays of the calling thread to this ray type
+void set_ray_type(RayType);
+// record a traversed ray and the number of acceleration structure nodes it visited
+void count_ray(uint64_t node_visits);
+// record primitive tests done without Primitive::intersect or Primitive::occludes
+void count_intersection_tests(uint64_t count);
+RayStatistics ray_statistics(RayType);
+void print_stats(double seconds);
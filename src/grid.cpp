@@ -0,0 +1,274 @@
+#include "grid.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <omp.h>
+
+// cells along each axis of a grid over bbox holding about density cells per primitive, with cubic cells
+static glm::ivec3 grid_resolution(const AABB& bbox, double density, size_t count, int max_resolution)
+{
+  rvec3 size = bbox.size();
+  double volume = size.x * size.y * size.z;
+  double cells_per_length = std::cbrt(density * double(count) / volume);
+
+  glm::ivec3 resolution;
+  for (int axis = 0; axis < 3; axis++) {
+    resolution[axis] = int(std::clamp(std::floor(size[axis] * cells_per_length), 1.0, double(max_resolution)));
+  }
+  return resolution;
+}
+
+// cell containing point, clamped to the grid
+static glm::ivec3 cell_at(const rvec3& point, const rvec3& origin, const rvec3& cell_size,
+                          const glm::ivec3& resolution)
+{
+  glm::ivec3 cell;
+  for (int axis = 0; axis < 3; axis++) {
+    real c = std::floor((point[axis] - origin[axis]) / cell_size[axis]);
+    cell[axis] = int(std::clamp(c, real(0), real(resolution[axis] - 1)));
+  }
+  return cell;
+}
+
+static uint32_t linear_index(const glm::ivec3& cell, const glm::ivec3& resolution)
+{
+  return uint32_t(cell.x + resolution.x * (cell.y + resolution.y * cell.z));
+}
+
+// Walk the cells of one grid the ray passes between t_min and t_max front to back (Amanatides and Woo
+// 1987). visit(cell, t_enter, t_exit) returns true to stop the walk, which then returns true as well.
+template <typename Visit>
+static bool walk_grid(const Ray& ray, const rvec3& inv_direction, const rvec3& origin,
+                      const rvec3& cell_size, const glm::ivec3& resolution, real t_min, real t_max,
+                      uint64_t& visits, const Visit& visit)
+{
+  constexpr real infinity = std::numeric_limits<real>::infinity();
+
+  glm::ivec3 cell = cell_at(ray.point_at(t_min), origin, cell_size, resolution);
+  glm::ivec3 step;
+  rvec3 t_next, t_delta;
+
+  for (int axis = 0; axis < 3; axis++) {
+    if (ray.direction[axis] > 0.0) {
+      step[axis] = 1;
+      t_next[axis] = (origin[axis] + (cell[axis] + 1) * cell_size[axis] - ray.origin[axis]) * inv_direction[axis];
+      t_delta[axis] = cell_size[axis] * inv_direction[axis];
+    } else if (ray.direction[axis] < 0.0) {
+      step[axis] = -1;
+      t_next[axis] = (origin[axis] + cell[axis] * cell_size[axis] - ray.origin[axis]) * inv_direction[axis];
+      t_delta[axis] = -cell_size[axis] * inv_direction[axis];
+    } else {
+      step[axis] = 0;
+      t_next[axis] = t_delta[axis] = infinity;
+    }
+  }
+
+  while (true) {
+    int axis = (t_next.x < t_next.y) ? ((t_next.x < t_next.z) ? 0 : 2) : ((t_next.y < t_next.z) ? 1 : 2);
+    real t_exit = std::min(t_next[axis], t_max);
+    visits++;
+
+    if (visit(cell, t_min, t_exit)) return true;
+    if (t_next[axis] >= t_max) return false;
+
+    cell[axis] += step[axis];
+    if (cell[axis] < 0 || cell[axis] >= resolution[axis]) return false;
+
+    t_min = t_next[axis];
+    t_next[axis] += t_delta[axis];
+  }
+}
+
+Grid::Grid(const std::vector<Primitive>& primitives, const GridConfig& config)
+    : m_config(config), m_primitives(primitives)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const size_t n = m_primitives.size();
+  m_bounds = compute_bounding_volume(m_primitives.begin(), m_primitives.end());
+
+  // flat scenes still need cells with some volume
+  rvec3 padding = rvec3(real(1e-6 * std::max(double(glm::length(m_bounds.size())), 1e-6)));
+  m_bounds.min -= padding;
+  m_bounds.max += padding;
+
+  m_resolution = grid_resolution(m_bounds, m_config.top_density, std::max(n, size_t(1)), 256);
+  m_cell_size = m_bounds.size() / rvec3(m_resolution);
+  m_top.resize(size_t(m_resolution.x) * m_resolution.y * m_resolution.z, TopCell{0, {0, 0, 0}});
+
+  // primitives of every top level cell, counted first and then filled in
+  std::vector<uint32_t> top_first(m_top.size() + 1, 0);
+  std::vector<uint32_t> top_primitives;
+
+  auto for_each_top_cell = [this](const AABB& bbox, const auto& body) {
+    glm::ivec3 lo = cell_at(bbox.min, m_bounds.min, m_cell_size, m_resolution);
+    glm::ivec3 hi = cell_at(bbox.max, m_bounds.min, m_cell_size, m_resolution);
+    for (int z = lo.z; z <= hi.z; z++) {
+      for (int y = lo.y; y <= hi.y; y++) {
+        for (int x = lo.x; x <= hi.x; x++) body(linear_index({x, y, z}, m_resolution));
+      }
+    }
+  };
+
+  for (const Primitive& p : m_primitives) {
+    for_each_top_cell(p.bbox, [&](uint32_t cell) { top_first[cell + 1]++; });
+  }
+  for (size_t i = 0; i < m_top.size(); i++) top_first[i + 1] += top_first[i];
+
+  top_primitives.resize(top_first.back());
+  std::vector<uint32_t> fill(top_first.begin(), top_first.end() - 1);
+  for (uint32_t i = 0; i < n; i++) {
+    for_each_top_cell(m_primitives[i].bbox, [&](uint32_t cell) { top_primitives[fill[cell]++] = i; });
+  }
+
+  // the grids of the top level cells are built independently and concatenated afterwards
+  std::vector<std::vector<Cell>> cells(m_top.size());
+  std::vector<std::vector<uint32_t>> indices(m_top.size());
+
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int top = 0; top < int(m_top.size()); top++) {
+    const uint32_t count = top_first[top + 1] - top_first[top];
+    if (count == 0) continue;
+
+    glm::ivec3 top_cell(top % m_resolution.x, (top / m_resolution.x) % m_resolution.y,
+                        top / (m_resolution.x * m_resolution.y));
+    AABB bbox;
+    bbox.min = m_bounds.min + rvec3(top_cell) * m_cell_size;
+    bbox.max = bbox.min + m_cell_size;
+
+    glm::ivec3 resolution = grid_resolution(bbox, m_config.cell_density, count, 255);
+    rvec3 cell_size = m_cell_size / rvec3(resolution);
+    for (int axis = 0; axis < 3; axis++) m_top[top].resolution[axis] = uint8_t(resolution[axis]);
+
+    auto for_each_cell = [&](const AABB& primitive_bbox, const auto& body) {
+      glm::ivec3 lo = cell_at(glm::max(primitive_bbox.min, bbox.min), bbox.min, cell_size, resolution);
+      glm::ivec3 hi = cell_at(glm::min(primitive_bbox.max, bbox.max), bbox.min, cell_size, resolution);
+      for (int z = lo.z; z <= hi.z; z++) {
+        for (int y = lo.y; y <= hi.y; y++) {
+          for (int x = lo.x; x <= hi.x; x++) body(linear_index({x, y, z}, resolution));
+        }
+      }
+    };
+
+    std::vector<Cell>& grid = cells[top];
+    grid.resize(size_t(resolution.x) * resolution.y * resolution.z, Cell{0, 0});
+
+    for (uint32_t i = top_first[top]; i < top_first[top + 1]; i++) {
+      for_each_cell(m_primitives[top_primitives[i]].bbox, [&](uint32_t cell) { grid[cell].count++; });
+    }
+
+    uint32_t first = 0;
+    for (Cell& cell : grid) {
+      cell.first = first;
+      first += cell.count;
+      cell.count = 0;
+    }
+
+    indices[top].resize(first);
+    for (uint32_t i = top_first[top]; i < top_first[top + 1]; i++) {
+      uint32_t primitive = top_primitives[i];
+      for_each_cell(m_primitives[primitive].bbox, [&](uint32_t cell) {
+        indices[top][grid[cell].first + grid[cell].count++] = primitive;
+      });
+    }
+  }
+
+  for (size_t top = 0; top < m_top.size(); top++) {
+    m_top[top].first_cell = uint32_t(m_cells.size());
+    uint32_t first = uint32_t(m_indices.size());
+    for (Cell cell : cells[top]) m_cells.push_back({first + cell.first, cell.count});
+    m_indices.insert(m_indices.end(), indices[top].begin(), indices[top].end());
+  }
+
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> duration = end - start;
+
+  std::cout << "Grid Resolution: " << m_resolution.x << "x" << m_resolution.y << "x" << m_resolution.z
+            << ", Cells: " << cell_count() << ", References: " << m_indices.size()
+            << ", Bytes/Primitive: " << double(memory()) / double(std::max(n, size_t(1)))
+            << ", Build time: " << duration.count() << " ms" << std::endl;
+}
+
+// intersect the ray with the grid bounds
+bool Grid::clip(const Ray& ray, const rvec3& inv_direction, real& t_min, real& t_max) const
+{
+  rvec3 t0 = (m_bounds.min - ray.origin) * inv_direction;
+  rvec3 t1 = (m_bounds.max - ray.origin) * inv_direction;
+  rvec3 t_near = glm::min(t0, t1);
+  rvec3 t_far = glm::max(t0, t1);
+  t_min = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, t_min));
+  t_max = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, t_max));
+  return t_min <= t_max;
+}
+
+template <typename Visit>
+bool Grid::walk(const Ray& ray, const rvec3& inv_direction, real t_min, real t_max, const Visit& visit) const
+{
+  uint64_t visits = 0;
+
+  auto visit_top_cell = [&](const glm::ivec3& top_cell, real t_enter, real t_exit) {
+    const TopCell& top = m_top[linear_index(top_cell, m_resolution)];
+    if (top.resolution[0] == 0) return false;
+
+    glm::ivec3 resolution(top.resolution[0], top.resolution[1], top.resolution[2]);
+    rvec3 origin = m_bounds.min + rvec3(top_cell) * m_cell_size;
+    rvec3 cell_size = m_cell_size / rvec3(resolution);
+
+    auto visit_cell = [&](const glm::ivec3& cell, real, real t_cell_exit) {
+      return visit(m_cells[top.first_cell + linear_index(cell, resolution)], t_cell_exit);
+    };
+    return walk_grid(ray, inv_direction, origin, cell_size, resolution, t_enter, t_exit, visits, visit_cell);
+  };
+
+  bool stopped = walk_grid(ray, inv_direction, m_bounds.min, m_cell_size, m_resolution, t_min, t_max, visits,
+                           visit_top_cell);
+  count_ray(visits);
+  return stopped;
+}
+
+std::optional<Hit> Grid::traverse(const Ray& ray) const
+{
+  const rvec3 inv_direction = real(1) / ray.direction;
+  real t_min = ray_epsilon, t_max = 1e9;
+  if (m_indices.empty() || !clip(ray, inv_direction, t_min, t_max)) {
+    count_ray(0);
+    return std::nullopt;
+  }
+
+  std::optional<Hit> result = std::nullopt;
+  real t_hit = 1e9;
+
+  // primitives spanning several cells are found again in later cells, only hits inside the current cell
+  // are known to be the closest
+  walk(ray, inv_direction, t_min, t_max, [&](const Cell& cell, real t_exit) {
+    for (uint32_t i = cell.first; i < cell.first + cell.count; i++) {
+      auto hit = m_primitives[m_indices[i]].intersect(ray, t_hit);
+      if (hit.has_value()) {
+        result = hit;
+        t_hit = hit->t;
+      }
+    }
+    return result.has_value() && t_hit <= t_exit;
+  });
+
+  return result;
+}
+
+bool Grid::occluded(const Ray& ray, real t_max) const
+{
+  const rvec3 inv_direction = real(1) / ray.direction;
+  real t_min = ray_epsilon, t_end = t_max;
+  if (m_indices.empty() || !clip(ray, inv_direction, t_min, t_end)) {
+    count_ray(0);
+    return false;
+  }
+
+  return walk(ray, inv_direction, t_min, t_end, [&](const Cell& cell, real) {
+    for (uint32_t i = cell.first; i < cell.first + cell.count; i++) {
+      if (m_primitives[m_indices[i]].occludes(ray, t_max)) return true;
+    }
+    return false;
+  });
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "aabb.h"
+#include "accelerator.h"
+#include "geometry.h"
+
+struct GridConfig {
+  double top_density = 0.0625;  // top level cells per primitive
+  double cell_density = 2.0;    // cells per primitive in each top level cell
+};
+
+// Two-level uniform grid (Kalojanov et al. 2011). The top level covers the scene with cells holding about
+// 1 / top_density primitives each, every non-empty top level cell is divided again into a grid with a
+// resolution matching the number of primitives in it. Rays walk both levels front to back with a 3D DDA
+// and stop at the first cell that contains a hit. Dense scenes of similar sized primitives trace well
+// with it, scenes with large empty regions or primitives of very different sizes do not.
+class Grid : public Accelerator
+{
+ public:
+  Grid(const std::vector<Primitive>&, const GridConfig& config = GridConfig());
+  std::optional<Hit> traverse(const Ray&) const override;
+  bool occluded(const Ray&, real t_max) const override;
+  const AABB& bounds() const override { return m_bounds; }
+  size_t cell_count() const { return m_top.size() + m_cells.size(); }
+  // bytes of cells and index list
+  size_t memory() const
+  {
+    return m_top.capacity() * sizeof(TopCell) + m_cells.capacity() * sizeof(Cell) +
+           m_indices.capacity() * sizeof(uint32_t);
+  }
+
+ private:
+
+  // top level cell, empty ones have a resolution of 0
+  struct TopCell {
+    uint32_t first_cell;    // first of the cells of its grid in m_cells, x varies fastest
+    uint8_t resolution[3];
+  };
+
+  // range of the primitive index list
+  struct Cell {
+    uint32_t first;
+    uint32_t count;
+  };
+
+  const GridConfig m_config;
+  AABB m_bounds;
+  glm::ivec3 m_resolution;
+  rvec3 m_cell_size;
+  std::vector<TopCell> m_top;
+  std::vector<Cell> m_cells;
+  std::vector<Primitive> m_primitives;
+  std::vector<uint32_t> m_indices;
+
+  bool clip(const Ray&, const rvec3& inv_direction, real& t_min, real& t_max) const;
+  // walk the top level and the grids of the cells the ray passes, visit(cell, t_exit) returns true to stop
+  template <typename Visit>
+  bool walk(const Ray&, const rvec3& inv_direction, real t_min, real t_max, const Visit& visit) const;
+};
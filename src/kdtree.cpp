@@ -0,0 +1,314 @@
+#include "kdtree.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+KdTree::KdTree(const std::vector<Primitive>& primitives, const KdTreeConfig& config)
+    : m_config(config), m_primitives(primitives)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const double n = double(std::max(m_primitives.size(), size_t(1)));
+  m_max_depth = (m_config.max_depth > 0) ? m_config.max_depth : size_t(8.0 + 1.3 * std::log2(n));
+  m_max_depth = std::min(m_max_depth, max_depth - 1);
+
+  std::vector<Reference> refs(m_primitives.size());
+  for (uint32_t i = 0; i < m_primitives.size(); i++) refs[i] = {m_primitives[i].bbox, i};
+
+  m_bounds = compute_bounding_volume(m_primitives.begin(), m_primitives.end());
+  build(refs, m_bounds, 0);
+
+  m_nodes.shrink_to_fit();
+  m_indices.shrink_to_fit();
+
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> duration = end - start;
+
+  std::cout << "KdTree Nodes: " << node_count() << ", References: " << m_indices.size()
+            << ", Bytes/Primitive: " << double(memory()) / n << ", Build time: " << duration.count() << " ms"
+            << std::endl;
+}
+
+void KdTree::build(std::vector<Reference>& refs, const AABB& bbox, size_t depth)
+{
+  const uint32_t index = uint32_t(m_nodes.size());
+  m_nodes.emplace_back();
+
+  Split split;
+  if (depth < m_max_depth && !refs.empty()) split = find_split(refs, bbox);
+
+  if (!(split.cost < m_config.intersection_cost * double(refs.size()))) {
+    m_nodes[index].first = uint32_t(m_indices.size());
+    m_nodes[index].data = (uint32_t(refs.size()) << 2) | 3;
+    for (const Reference& ref : refs) m_indices.push_back(ref.index);
+    return;
+  }
+
+  const size_t axis = split.axis;
+  const double position = split.position;
+  std::vector<Reference> left, right;
+
+  for (const Reference& ref : refs) {
+    double lo = ref.bbox.min[axis], hi = ref.bbox.max[axis];
+
+    if (lo == position && hi == position) {
+      (split.planar_left ? left : right).push_back(ref);
+    } else if (hi <= position) {
+      left.push_back(ref);
+    } else if (lo >= position) {
+      right.push_back(ref);
+    } else {
+      Reference l = ref, r = ref;
+      l.bbox.max[axis] = position;
+      r.bbox.min[axis] = position;
+      left.push_back(l);
+      right.push_back(r);
+    }
+  }
+
+  // the references of this node are not needed anymore while the children are built
+  refs = std::vector<Reference>();
+
+  AABB left_bbox = bbox, right_bbox = bbox;
+  left_bbox.max[axis] = position;
+  right_bbox.min[axis] = position;
+
+  build(left, left_bbox, depth + 1);
+
+  m_nodes[index].split = float(position);
+  m_nodes[index].data = (uint32_t(m_nodes.size()) << 2) | uint32_t(axis);
+
+  build(right, right_bbox, depth + 1);
+}
+
+// Sweep over the sorted bounds of all references on each axis. At every candidate plane the references
+// ending at or before it are on the left, the ones starting at or after it on the right, and the ones lying
+// in it are tried on both sides.
+KdTree::Split KdTree::find_split(const std::vector<Reference>& refs, const AABB& bbox) const
+{
+  enum EventType : uint8_t { END, PLANAR, START };
+
+  struct Event {
+    double position;
+    EventType type;
+    bool operator<(const Event& other) const
+    {
+      return position < other.position || (position == other.position && type < other.type);
+    }
+  };
+
+  Split best;
+  const double area = bbox.area();
+  if (!(area > 0.0)) return best;
+
+  const size_t n = refs.size();
+  std::vector<Event> events;
+  events.reserve(2 * n);
+
+  auto cost = [&](double p_left, double p_right, size_t n_left, size_t n_right) {
+    double bonus = (n_left == 0 || n_right == 0) ? 1.0 - m_config.empty_bonus : 1.0;
+    return bonus * (m_config.traversal_cost +
+                    m_config.intersection_cost * (p_left * double(n_left) + p_right * double(n_right)));
+  };
+
+  for (size_t axis = 0; axis < 3; axis++) {
+    if (!(bbox.max[axis] > bbox.min[axis])) continue;
+
+    events.clear();
+    for (const Reference& ref : refs) {
+      if (ref.bbox.min[axis] == ref.bbox.max[axis]) {
+        events.push_back({ref.bbox.min[axis], PLANAR});
+      } else {
+        events.push_back({ref.bbox.min[axis], START});
+        events.push_back({ref.bbox.max[axis], END});
+      }
+    }
+    std::sort(events.begin(), events.end());
+
+    size_t n_left = 0, n_right = n;
+
+    for (size_t i = 0; i < events.size();) {
+      const double position = events[i].position;
+      size_t ends = 0, planars = 0, starts = 0;
+      while (i < events.size() && events[i].position == position && events[i].type == END) ends++, i++;
+      while (i < events.size() && events[i].position == position && events[i].type == PLANAR) planars++, i++;
+      while (i < events.size() && events[i].position == position && events[i].type == START) starts++, i++;
+
+      n_right -= planars + ends;
+
+      // planes on the node bounds would create an empty child without any volume
+      if (position > bbox.min[axis] && position < bbox.max[axis]) {
+        AABB left = bbox, right = bbox;
+        left.max[axis] = position;
+        right.min[axis] = position;
+        double p_left = left.area() / area, p_right = right.area() / area;
+
+        double planar_left = cost(p_left, p_right, n_left + planars, n_right);
+        double planar_right = cost(p_left, p_right, n_left, n_right + planars);
+
+        if (std::min(planar_left, planar_right) < best.cost) {
+          best.cost = std::min(planar_left, planar_right);
+          best.axis = axis;
+          best.position = position;
+          best.planar_left = planar_left <= planar_right;
+        }
+      }
+
+      n_left += starts + planars;
+    }
+  }
+
+  // the split planes are stored in single precision, keep the partition consistent with them
+  best.position = double(float(best.position));
+  return best;
+}
+
+// intersect the ray with the scene bounds
+bool KdTree::clip(const Ray& ray, const rvec3& inv_direction, real& t_min, real& t_max) const
+{
+  rvec3 t0 = (m_bounds.min - ray.origin) * inv_direction;
+  rvec3 t1 = (m_bounds.max - ray.origin) * inv_direction;
+  rvec3 t_near = glm::min(t0, t1);
+  rvec3 t_far = glm::max(t0, t1);
+  t_min = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, t_min));
+  t_max = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, t_max));
+  return t_min <= t_max;
+}
+
+std::optional<Hit> KdTree::traverse(const Ray& ray) const
+{
+  const rvec3 inv_direction = real(1) / ray.direction;
+  real t_min = ray_epsilon, t_max = 1e9;
+  if (m_indices.empty() || !clip(ray, inv_direction, t_min, t_max)) {
+    count_ray(0);
+    return std::nullopt;
+  }
+
+  struct Entry {
+    uint32_t index;
+    real t_min, t_max;
+  };
+
+  Entry stack[max_depth];
+  size_t stack_size = 0;
+  uint32_t index = 0;
+  uint64_t visits = 0;
+
+  std::optional<Hit> result = std::nullopt;
+  real t_hit = 1e9;
+
+  while (true) {
+    const Node* node = &m_nodes[index];
+    visits++;
+
+    while (!node->is_leaf()) {
+      const uint32_t axis = node->axis();
+      const real t_split = (real(node->split) - ray.origin[axis]) * inv_direction[axis];
+
+      uint32_t near = index + 1, far = node->right();
+      bool below = ray.origin[axis] < node->split || (ray.origin[axis] == node->split && ray.direction[axis] <= 0.0);
+      if (!below) std::swap(near, far);
+
+      // a ray lying in the split plane gives NaN and stays on the near side
+      if (!(t_split > 0.0) || t_split > t_max) {
+        index = near;
+      } else if (t_split < t_min) {
+        index = far;
+      } else {
+        stack[stack_size++] = {far, t_split, t_max};
+        index = near;
+        t_max = t_split;
+      }
+
+      node = &m_nodes[index];
+      visits++;
+    }
+
+    for (uint32_t i = node->first; i < node->first + node->count(); i++) {
+      auto hit = m_primitives[m_indices[i]].intersect(ray, t_hit);
+      if (hit.has_value()) {
+        result = hit;
+        t_hit = hit->t;
+      }
+    }
+
+    // leaves are visited front to back, a hit inside this leaf is closer than anything behind it
+    if (result.has_value() && t_hit <= t_max) break;
+    if (stack_size == 0) break;
+
+    Entry entry = stack[--stack_size];
+    if (entry.t_min > t_hit) break;
+    index = entry.index;
+    t_min = entry.t_min;
+    t_max = entry.t_max;
+  }
+
+  count_ray(visits);
+  return result;
+}
+
+bool KdTree::occluded(const Ray& ray, real t_max) const
+{
+  const rvec3 inv_direction = real(1) / ray.direction;
+  const real t_limit = t_max;
+  real t_min = ray_epsilon;
+  if (m_indices.empty() || !clip(ray, inv_direction, t_min, t_max)) {
+    count_ray(0);
+    return false;
+  }
+
+  struct Entry {
+    uint32_t index;
+    real t_min, t_max;
+  };
+
+  Entry stack[max_depth];
+  size_t stack_size = 0;
+  uint32_t index = 0;
+  uint64_t visits = 0;
+
+  while (true) {
+    const Node* node = &m_nodes[index];
+    visits++;
+
+    while (!node->is_leaf()) {
+      const uint32_t axis = node->axis();
+      const real t_split = (real(node->split) - ray.origin[axis]) * inv_direction[axis];
+
+      uint32_t near = index + 1, far = node->right();
+      bool below = ray.origin[axis] < node->split || (ray.origin[axis] == node->split && ray.direction[axis] <= 0.0);
+      if (!below) std::swap(near, far);
+
+      if (!(t_split > 0.0) || t_split > t_max) {
+        index = near;
+      } else if (t_split < t_min) {
+        index = far;
+      } else {
+        stack[stack_size++] = {far, t_split, t_max};
+        index = near;
+        t_max = t_split;
+      }
+
+      node = &m_nodes[index];
+      visits++;
+    }
+
+    for (uint32_t i = node->first; i < node->first + node->count(); i++) {
+      if (m_primitives[m_indices[i]].occludes(ray, t_limit)) {
+        count_ray(visits);
+        return true;
+      }
+    }
+
+    if (stack_size == 0) break;
+
+    Entry entry = stack[--stack_size];
+    index = entry.index;
+    t_min = entry.t_min;
+    t_max = entry.t_max;
+  }
+
+  count_ray(visits);
+  return false;
+}
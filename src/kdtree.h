@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include "aabb.h"
+#include "accelerator.h"
+#include "geometry.h"
+
+struct KdTreeConfig {
+  double traversal_cost = 1.0;     // cost of visiting an interior node
+  double intersection_cost = 1.5;  // cost of intersecting a primitive
+  double empty_bonus = 0.2;        // cost reduction of splits that cut off empty space
+  size_t max_depth = 0;            // 0 picks 8 + 1.3 log2(n)
+};
+
+// Kd-tree built with the surface area heuristic, evaluating every primitive bound as a split candidate
+// (Wald and Havran 2006). Primitives that straddle a split plane are referenced from both sides, with
+// their bounds clipped to either side. Traversal visits the leaves front to back and stops at the first
+// leaf that contains a hit.
+class KdTree : public Accelerator
+{
+ public:
+  // traversal stack size, the builder never creates deeper trees
+  static constexpr size_t max_depth = 64;
+
+  // 8 byte node. The left child of an interior node follows it, the right one is at `right()`. Leaves
+  // hold `count()` entries of the primitive index list starting at `first`.
+  struct Node {
+    union {
+      float split;
+      uint32_t first;
+    };
+    uint32_t data;  // bits 0-1: split axis or 3 for leaves, bits 2-31: right child or primitive count
+    inline bool is_leaf() const { return (data & 3) == 3; }
+    inline uint32_t axis() const { return data & 3; }
+    inline uint32_t right() const { return data >> 2; }
+    inline uint32_t count() const { return data >> 2; }
+  };
+
+  static_assert(sizeof(Node) == 8);
+
+  KdTree(const std::vector<Primitive>&, const KdTreeConfig& config = KdTreeConfig());
+  std::optional<Hit> traverse(const Ray&) const override;
+  bool occluded(const Ray&, real t_max) const override;
+  const AABB& bounds() const override { return m_bounds; }
+  size_t node_count() const { return m_nodes.size(); }
+  // bytes of nodes and index list
+  size_t memory() const { return m_nodes.capacity() * sizeof(Node) + m_indices.capacity() * sizeof(uint32_t); }
+
+ private:
+
+  // primitive bounds clipped to the node
+  struct Reference {
+    AABB bbox;
+    uint32_t index;
+  };
+
+  struct Split {
+    double cost = std::numeric_limits<double>::infinity();
+    size_t axis = 0;
+    double position = 0.0;
+    bool planar_left = true;  // primitives lying in the split plane go to the left child
+  };
+
+  const KdTreeConfig m_config;
+  size_t m_max_depth;
+  AABB m_bounds;
+  std::vector<Node> m_nodes;
+  std::vector<Primitive> m_primitives;
+  std::vector<uint32_t> m_indices;
+
+  void build(std::vector<Reference>& refs, const AABB& bbox, size_t depth);
+  Split find_split(const std::vector<Reference>& refs, const AABB& bbox) const;
+  bool clip(const Ray&, const rvec3& inv_direction, real& t_min, real& t_max) const;
+};
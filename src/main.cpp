@@ -5,6 +5,8 @@
 #include "renderer.h"
 #include "scene.h"
 #include "image.h"
+#include "bvh.h"
+#include <algorithm>
 #include <chrono>
 #include <memory>
 #include <ratio>
@@ -26,11 +28,25 @@ struct SimpleSphere : public Sphere {
   bool hidden;
 };
 
+struct SimpleInstance {
+  std::string model;
+  glm::dmat4 transform;
+};
+
+// moves the primitives of one of the models by the transform once per frame after the first
+struct SimpleMotion {
+  int model;
+  glm::dmat4 transform;
+};
+
 struct Config {
   bool print_progress;
   int max_bounce;
   int samples_per_pixel;
   int batch_size;
+  int packet_size;
+  Integrator integrator;
+  bool sort_rays;
   int image_width;
   int image_height;
 
@@ -42,9 +58,16 @@ struct Config {
 
   std::vector<std::string> models;
   std::vector<SimpleSphere> spheres;
+  std::vector<SimpleInstance> instances;
+
+  int frames;
+  std::vector<SimpleMotion> motions;
 
   std::string background_texture;
   glm::dvec3 background_color;
+
+  AcceleratorConfig accelerator;
+  std::string stats_output;
 };
 
 namespace glm
@@ -86,11 +109,100 @@ static void from_json(const json& j, SimpleSphere& s)
   }
 }
 
+// the transform is given row by row, as it is written on paper
+static glm::dmat4 read_transform(const json& j, const std::string& name)
+{
+  glm::dmat4 transform(1.0);
+
+  if (contains_key(j, "transform")) {
+    auto values = j["transform"].get<std::vector<double>>();
+    if (values.size() != 16) {
+      std::cerr << name << " needs 16 values" << std::endl;
+      exit(1);
+    }
+    for (int row = 0; row < 4; row++) {
+      for (int column = 0; column < 4; column++) transform[column][row] = values[row * 4 + column];
+    }
+  }
+
+  return transform;
+}
+
+static void from_json(const json& j, SimpleInstance& i)
+{
+  i.model = j["model"];
+  i.transform = read_transform(j, "Instance transform of " + i.model);
+}
+
+static void from_json(const json& j, SimpleMotion& m)
+{
+  m.model = j["model"];
+  m.transform = read_transform(j, "Motion transform of model " + std::to_string(m.model));
+}
+
+static void from_json(const json& j, BVHConfig& c)
+{
+  auto builder = get_or_else(j, "builder", std::string("SAH"));
+
+  if (builder == "MEDIAN") {
+    c.builder = BVHConfig::MEDIAN;
+  } else if (builder == "SBVH") {
+    c.builder = BVHConfig::SBVH;
+  } else {
+    c.builder = BVHConfig::SAH;
+  }
+
+  auto layout = get_or_else(j, "layout", std::string("DEPTH_FIRST"));
+  c.layout = (layout == "TREELET") ? BVHConfig::TREELET : BVHConfig::DEPTH_FIRST;
+  c.treelet_size = get_or_else(j, "treelet_size", c.treelet_size);
+
+  c.bins = get_or_else(j, "bins", c.bins);
+  c.traversal_cost = get_or_else(j, "traversal_cost", c.traversal_cost);
+  c.intersection_cost = get_or_else(j, "intersection_cost", c.intersection_cost);
+  c.min_leaf_size = get_or_else(j, "min_leaf_size", c.min_leaf_size);
+  c.max_leaf_size = get_or_else(j, "max_leaf_size", c.max_leaf_size);
+  c.threads = get_or_else(j, "threads", c.threads);
+  c.width = get_or_else(j, "width", c.width);
+  c.quantized = get_or_else(j, "quantized", c.quantized);
+  c.spatial_alpha = get_or_else(j, "spatial_alpha", c.spatial_alpha);
+  c.max_duplication = get_or_else(j, "max_duplication", c.max_duplication);
+  c.rebuild_threshold = get_or_else(j, "rebuild_threshold", c.rebuild_threshold);
+  c.optimize_time = get_or_else(j, "optimize_time", c.optimize_time);
+  c.lazy = get_or_else(j, "lazy", c.lazy);
+  c.lazy_size = get_or_else(j, "lazy_size", c.lazy_size);
+  c.meshlets = get_or_else(j, "meshlets", c.meshlets);
+
+  if (c.quantized && c.max_leaf_size > QBVH::max_leaf_size) {
+    std::cout << "Quantized BVH leaves hold at most " << QBVH::max_leaf_size << " primitives, clamping max_leaf_size"
+              << std::endl;
+    c.max_leaf_size = QBVH::max_leaf_size;
+    c.min_leaf_size = std::min(c.min_leaf_size, c.max_leaf_size);
+  }
+}
+
+static void from_json(const json& j, KdTreeConfig& c)
+{
+  c.traversal_cost = get_or_else(j, "traversal_cost", c.traversal_cost);
+  c.intersection_cost = get_or_else(j, "intersection_cost", c.intersection_cost);
+  c.empty_bonus = get_or_else(j, "empty_bonus", c.empty_bonus);
+  c.max_depth = get_or_else(j, "max_depth", c.max_depth);
+}
+
+static void from_json(const json& j, GridConfig& c)
+{
+  c.top_density = get_or_else(j, "top_density", c.top_density);
+  c.cell_density = get_or_else(j, "cell_density", c.cell_density);
+}
+
 static void from_json(const json& j, Config& c)
 {
   c.print_progress = get_or_else(j, "print_progress", false);
   c.image_width = get_or_else(j, "image_width", 640);
   c.image_height = get_or_else(j, "image_height", 480);
+  c.packet_size = get_or_else(j, "packet_size", 1);
+  auto integrator = get_or_else(j, "integrator", std::string("RECURSIVE"));
+  c.integrator = (integrator == "WAVEFRONT") ? Integrator::WAVEFRONT : Integrator::RECURSIVE;
+  c.sort_rays = get_or_else(j, "sort_rays", false);
 
   c.camera_position = get_or_else(j, "camera_position", glm::dvec3(0.0, 0.0, 10.0));
   c.camera_target = get_or_else(j, "camera_target", glm::dvec3(0.0, 0.0, 0.0));
@@ -108,17 +220,113 @@ static void from_json(const json& j, Config& c)
   if (contains_key(j, "spheres")) {
     c.spheres = j["spheres"].get<std::vector<SimpleSphere>>();
   }
+
+  if (contains_key(j, "instances")) {
+    c.instances = j["instances"].get<std::vector<SimpleInstance>>();
+  }
+
+  c.frames = 1;
+  if (contains_key(j, "animation")) {
+    const json& animation = j["animation"];
+    c.frames = std::max(get_or_else(animation, "frames", 1), 1);
+    if (contains_key(animation, "motions")) {
+      c.motions = animation["motions"].get<std::vector<SimpleMotion>>();
+    }
+    for (const auto& motion : c.motions) {
+      if (motion.model < 0 || motion.model >= int(c.models.size())) {
+        std::cerr << "Motion of model " << motion.model << " refers to no entry of models" << std::endl;
+        exit(1);
+      }
+    }
+  }
+
+  auto accelerator = get_or_else(j, "accelerator", std::string("BVH"));
+
+  if (accelerator == "KD_TREE") {
+    c.accelerator.type = AcceleratorConfig::KD_TREE;
+  } else if (accelerator == "GRID") {
+    c.accelerator.type = AcceleratorConfig::GRID;
+  } else {
+    c.accelerator.type = AcceleratorConfig::BVH;
+  }
+
+  if (contains_key(j, "bvh")) {
+    from_json(j["bvh"], c.accelerator.bvh);
+  }
+
+  if (contains_key(j, "kd_tree")) {
+    from_json(j["kd_tree"], c.accelerator.kd_tree);
+  }
+
+  if (contains_key(j, "grid")) {
+    from_json(j["grid"], c.accelerator.grid);
+  }
+
+  c.stats_output = get_or_else(j, "stats_output", std::string());
+}
+
+static void to_json(json& j, const BVHStatistics& s)
+{
+  j = json{{"node_count", s.node_count},
+           {"leaf_count", s.leaf_count},
+           {"reference_count", s.reference_count},
+           {"depth_histogram", s.depth_histogram},
+           {"leaf_size_histogram", s.leaf_size_histogram},
+           {"sah_cost", s.sah_cost},
+           {"overlap", s.overlap},
+           {"memory", s.memory},
+           {"cache_misses", s.cache_misses},
+           {"unbuilt_count", s.unbuilt_count}};
+}
+
+static void to_json(json& j, const RayStatistics& s)
+{
+  double rays = std::max(double(s.rays), 1.0);
+  j = json{{"rays", s.rays},
+           {"node_visits", s.node_visits},
+           {"intersection_tests", s.intersection_tests},
+           {"node_visits_per_ray", double(s.node_visits) / rays},
+           {"intersection_tests_per_ray", double(s.intersection_tests) / rays}};
+}
+
+static void write_stats(const std::filesystem::path& path, const Scene& scene, double seconds)
+{
+  json j;
+  if (scene.bvh()) j["bvh"] = scene.bvh()->statistics();
+  j["render_seconds"] = seconds;
+  j["camera_rays"] = ray_statistics(RayType::CAMERA);
+  j["indirect_rays"] = ray_statistics(RayType::INDIRECT);
+  j["shadow_rays"] = ray_statistics(RayType::SHADOW);
+
+  std::ofstream file(path);
+  if (!file.is_open()) {
+    std::cerr << "Could not write stats: " << path.string() << std::endl;
+    return;
+  }
+  file << j.dump(2) << std::endl;
+  std::cout << "Wrote stats to " << path.string() << std::endl;
 }
 
-std::tuple<std::unique_ptr<Scene>, std::unique_ptr<Camera>> setup_scene(const Config& config)
+// the primitives [begin, end) of the scene that each model was loaded into
+using ModelRange = std::pair<uint32_t, uint32_t>;
+
+std::tuple<std::unique_ptr<Scene>, std::unique_ptr<Camera>, std::vector<ModelRange>> setup_scene(
+    const Config& config)
 {
   auto scene = std::make_unique<Scene>();
+  std::vector<ModelRange> model_ranges;
 
   for (const std::string path : config.models) {
     auto mesh = scene->load_obj(path);
     AABB bbox = compute_bounding_volume(mesh.begin(), mesh.end());
     std::cout << "Mesh Size: " << bbox.size() << ", Mesh Center: " << bbox.center() << std::endl;
+    const uint32_t begin = uint32_t(scene->primitive_count());
     scene->add_primitives(mesh.begin(), mesh.end());
+    model_ranges.emplace_back(begin, uint32_t(scene->primitive_count()));
+  }
+
+  for (const auto& instance : config.instances) {
+    scene->add_instance(instance.model, instance.transform);
   }
 
   for (const auto& s : config.spheres) {
@@ -164,9 +372,17 @@ std::tuple<std::unique_ptr<Scene>, std::unique_ptr<Camera>> setup_scene(const Co
   std::cout << "Distance camera position to camera target: "
             << glm::distance(config.camera_position, config.camera_target) << std::endl;
 
-  scene->compute_bvh();
+  scene->compute_accelerator(config.accelerator);
 
-  return std::make_tuple(std::move(scene), std::move(camera));
+  return std::make_tuple(std::move(scene), std::move(camera), std::move(model_ranges));
+}
+
+// image of one frame of an animation, the frame number goes before the extension
+static std::filesystem::path frame_path(const std::filesystem::path& path, int frame)
+{
+  std::string number = std::to_string(frame);
+  number.insert(0, number.size() < 4 ? 4 - number.size() : 0, '0');
+  return path.parent_path() / (path.stem().string() + "_" + number + path.extension().string());
 }
 
 int main(int argc, char** argv)
@@ -212,7 +428,7 @@ int main(int argc, char** argv)
   const auto now = std::chrono::system_clock::now();
   const auto timestamp = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
 
-  auto [scene, camera] = setup_scene(config);
+  auto [scene, camera, model_ranges] = setup_scene(config);
 
   if (!scene) {
     std::cerr << "Failed to setup scene!\n";
@@ -226,45 +442,72 @@ int main(int argc, char** argv)
 
   std::cout << "Samples Per Pixel: " << config.samples_per_pixel << std::endl;
   std::cout << "Max Bounce Depth: " << config.max_bounce << std::endl;
+  std::cout << "Packet Size: " << config.packet_size << std::endl;
+  std::cout << "Integrator: " << (config.integrator == Integrator::WAVEFRONT ? "WAVEFRONT" : "RECURSIVE") << std::endl;
+  std::cout << "Sort Rays: " << config.sort_rays << std::endl;
   std::cout << "Camera Position: " << camera->position() << std::endl;
   std::cout << "Camera Direction: " << camera->direction() << std::endl;
   std::cout << "Camera Resolution: " << camera->resolution() << std::endl;
   std::cout << "Scene Size: " << scene->size() << std::endl;
   std::cout << "Scene Center: " << scene->center() << std::endl;
   std::cout << "Primitive Count: " << scene->primitive_count() << std::endl;
+  std::cout << "Instance Count: " << scene->instance_count() << std::endl;
+  std::cout << "Frames: " << config.frames << std::endl;
 
-  Renderer renderer(camera.get(), scene.get(), config.max_bounce);
+  Renderer renderer(camera.get(), scene.get(), config.max_bounce, config.packet_size, config.integrator,
+                    config.sort_rays);
 
   auto start = std::chrono::high_resolution_clock::now();
 
-  int batch = config.batch_size;
+  for (int frame = 0; frame < config.frames; frame++) {
+    if (frame > 0) {
+      for (const auto& motion : config.motions) {
+        auto [begin, end] = model_ranges[motion.model];
+        scene->transform_primitives(begin, end, motion.transform);
+      }
+      scene->update_accelerator();
+
+      // save the previous frame and start the next image from scratch
+      renderer.save_image(frame_path(result_path, frame - 1));
+      renderer.total_samples = 0;
+      std::cout << "Frame: " << frame << std::endl;
+    }
 
-  if (0 < batch) {
-    while (renderer.total_samples < config.samples_per_pixel) {
-      int todo = config.samples_per_pixel - renderer.total_samples;
-      if (batch > todo) batch = todo;
-      renderer.render(batch, config.print_progress);
+    int batch = config.batch_size;
 
-      printf("%d/%d samples per pixel\n", renderer.total_samples, config.samples_per_pixel);
+    if (0 < batch) {
+      while (renderer.total_samples < config.samples_per_pixel) {
+        int todo = config.samples_per_pixel - renderer.total_samples;
+        if (batch > todo) batch = todo;
+        renderer.render(batch, config.print_progress);
 
-      auto path = result_path.parent_path() / std::filesystem::path("latest.png");
-      renderer.save_image(path);
+        printf("%d/%d samples per pixel\n", renderer.total_samples, config.samples_per_pixel);
+
+        auto path = result_path.parent_path() / std::filesystem::path("latest.png");
+        renderer.save_image(path);
+      }
+    } else {
+      renderer.render(config.samples_per_pixel, config.print_progress);
     }
-  } else {
-    renderer.render(config.samples_per_pixel, config.print_progress);
   }
 
   auto end = std::chrono::high_resolution_clock::now();
 
   std::chrono::duration<double, std::milli> duration = end - start;
   double seconds = duration.count() / 1000.0;
+  print_stats(seconds);
+  renderer.print_stats();
+
+  if (!config.stats_output.empty()) {
+    write_stats(config.stats_output, *scene, seconds);
+  }
+
   int minutes = seconds / 60;
   seconds -= (minutes * 60);
 
-  print_stats();
   printf("%d Samples/Pixel\n", renderer.total_samples);
   fprintf(stdout, "Render time: %dm%.3fs\n", minutes, seconds);
 
-  renderer.save_image(result_path);
+  renderer.save_image(config.frames > 1 ? frame_path(result_path, config.frames - 1) : result_path);
   return 0;
 }
\ No newline at end of file
@@ -148,9 +148,9 @@ glm::dvec3 BxDF::eval_diffuse(const glm::dvec3& wo, const glm::dvec3& wi) const
 #if 0
   double cos_theta = CosTheta(wi);
   double pdf = cos_theta / pi;
-  return ((surface->albedo() / pi)) * cos_theta / pdf;
+  return ((surface->albedo / pi)) * cos_theta / pdf;
 #else
-  return surface->albedo();
+  return surface->albedo;
 #endif
 }
 
@@ -161,7 +161,7 @@ glm::dvec3 BxDF::sample_specular(const glm::dvec3& V) const
   return glm::reflect(-V, N) + (fuzz * random_unit_vector());
 }
 
-glm::dvec3 BxDF::eval_specular(const glm::dvec3& V, const glm::dvec3& L) const { return surface->albedo(); }
+glm::dvec3 BxDF::eval_specular(const glm::dvec3& V, const glm::dvec3& L) const { return surface->albedo; }
 
 glm::dvec3 BxDF::sample_microfacet(const glm::dvec3& V) const
 {
@@ -178,7 +178,7 @@ glm::dvec3 BxDF::eval_microfacet(const glm::dvec3& V, const glm::dvec3& L) const
   if (L.y < 0.0 || V.y < 0.0) return glm::dvec3(0);
 #endif
 
-  glm::dvec3 base_color = surface->albedo();
+  glm::dvec3 base_color = surface->albedo;
   double metallic = surface->material->metallic;
   double roughness = surface->material->roughness;
 
@@ -220,7 +220,7 @@ glm::dvec3 BxDF::sample_mirror(const glm::dvec3& V) const
   return glm::reflect(-V, N);
 }
 
-glm::dvec3 BxDF::eval_mirror(const glm::dvec3& V, const glm::dvec3& L) const { return surface->albedo(); }
+glm::dvec3 BxDF::eval_mirror(const glm::dvec3& V, const glm::dvec3& L) const { return surface->albedo; }
 
 glm::dvec3 BxDF::sample_dielectric(const glm::dvec3& V) const
 {
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <glm/glm.hpp>
+
+#include "ray.h"
+
+// Rays of a block of pixels that are traversed together. The single precision copies used for box tests
+// are stored as structure of arrays, so testing all rays against one box vectorizes. The bounds of the
+// origins and reciprocal directions allow rejecting a box for the whole packet with a single test.
+struct RayPacket {
+  static constexpr size_t max_size = 64;  // 8x8 pixels
+
+  Ray rays[max_size];
+  float origin[3][max_size];
+  float inv_direction[3][max_size];
+  uint64_t active = 0;  // bit mask of the lanes holding a ray
+  size_t size = 0;
+
+  glm::vec3 origin_min, origin_max;
+  glm::vec3 inv_direction_min, inv_direction_max;
+  bool coherent = true;  // all rays have the same direction sign on each axis
+
+  void clear()
+  {
+    active = 0;
+    size = 0;
+    coherent = true;
+    origin_min = inv_direction_min = glm::vec3(std::numeric_limits<float>::max());
+    origin_max = inv_direction_max = glm::vec3(std::numeric_limits<float>::lowest());
+  }
+
+  void add(const Ray& ray)
+  {
+    const size_t lane = size++;
+    rays[lane] = ray;
+    active |= uint64_t(1) << lane;
+
+    for (int axis = 0; axis < 3; axis++) {
+      float o = float(ray.origin[axis]);
+      float inv = float(1.0 / ray.direction[axis]);
+      origin[axis][lane] = o;
+      inv_direction[axis][lane] = inv;
+      origin_min[axis] = std::min(origin_min[axis], o);
+      origin_max[axis] = std::max(origin_max[axis], o);
+      inv_direction_min[axis] = std::min(inv_direction_min[axis], inv);
+      inv_direction_max[axis] = std::max(inv_direction_max[axis], inv);
+
+      // interval arithmetic needs finite reciprocals that do not change sign
+      if (!std::isfinite(inv) || (inv_direction_min[axis] < 0.0f && inv_direction_max[axis] > 0.0f)) {
+        coherent = false;
+      }
+    }
+  }
+};
+
+// Interval arithmetic test of a coherent packet, false if no ray of the packet can hit the box in [t_min, t_max].
+// Every ray has the same near and far plane per axis, the distance to a plane is bounded by multiplying the
+// range of plane to origin offsets with the range of reciprocal directions.
+inline bool packet_may_hit(const RayPacket& p, const glm::vec3& min, const glm::vec3& max, float t_min, float t_max)
+{
+  float t_entry = t_min, t_exit = t_max;
+
+  for (int axis = 0; axis < 3; axis++) {
+    bool positive = p.inv_direction_min[axis] > 0.0f;
+    float near = positive ? min[axis] : max[axis];
+    float far = positive ? max[axis] : min[axis];
+    float i0 = p.inv_direction_min[axis], i1 = p.inv_direction_max[axis];
+
+    float n0 = near - p.origin_max[axis], n1 = near - p.origin_min[axis];
+    t_entry = std::max(t_entry, std::min(std::min(n0 * i0, n0 * i1), std::min(n1 * i0, n1 * i1)));
+
+    float f0 = far - p.origin_max[axis], f1 = far - p.origin_min[axis];
+    t_exit = std::min(t_exit, std::max(std::max(f0 * i0, f0 * i1), std::max(f1 * i0, f1 * i1)));
+  }
+
+  return t_entry <= t_exit;
+}
+
+// slab test of every ray in the packet, returns the bit mask of the active rays that hit the box before their t_max
+inline uint64_t packet_vs_aabb(const RayPacket& p, const glm::vec3& min, const glm::vec3& max, float t_min,
+                               const float* t_max)
+{
+  uint64_t mask = 0;
+
+  for (size_t i = 0; i < p.size; i++) {
+    float t_entry = t_min, t_exit = t_max[i];
+    for (int axis = 0; axis < 3; axis++) {
+      float t0 = (min[axis] - p.origin[axis][i]) * p.inv_direction[axis][i];
+      float t1 = (max[axis] - p.origin[axis][i]) * p.inv_direction[axis][i];
+      t_entry = std::max(t_entry, std::min(t0, t1));
+      t_exit = std::min(t_exit, std::max(t0, t1));
+    }
+    mask |= uint64_t(t_entry <= t_exit) << i;
+  }
+
+  return mask & p.active;
+}
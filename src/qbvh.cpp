@@ -0,0 +1,334 @@
+#include "qbvh.h"
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PT_SSE2 1
+#include <emmintrin.h>
+#else
+#define PT_SSE2 0
+#endif
+
+// 2^e built from the exponent bits, e has to be in [-126, 127]
+static inline float exp2i(int8_t e) { return std::bit_cast<float>(uint32_t(e + 127) << 23); }
+
+// smallest power of two cell size for which 255 cells starting at min reach max
+static int8_t grid_exponent(float min, float max)
+{
+  float extent = max - min;
+  int e = (extent > 0.0f) ? int(std::ceil(std::log2(extent / 255.0f))) : -126;
+  e = std::clamp(e, -126, 127);
+  while (e < 127 && min + 255.0f * exp2i(int8_t(e)) < max) e++;
+  return int8_t(e);
+}
+
+// grid cell at or below value, checked with the same arithmetic used for decoding
+static uint8_t quantize_down(float value, float origin, float scale)
+{
+  int q = std::clamp(int(std::floor((value - origin) / scale)), 0, 255);
+  while (q > 0 && origin + float(q) * scale > value) q--;
+  return uint8_t(q);
+}
+
+static uint8_t quantize_up(float value, float origin, float scale)
+{
+  int q = std::clamp(int(std::ceil((value - origin) / scale)), 0, 255);
+  while (q < 255 && origin + float(q) * scale < value) q++;
+  return uint8_t(q);
+}
+
+// ray data shared by all box tests of one traversal
+struct RayQBVH {
+  glm::vec3 origin;
+  glm::vec3 inv_direction;
+  // row of Node::bounds holding the near plane of each axis, the far plane is in row + 3 mod 6
+  int near[3], far[3];
+
+  RayQBVH(const Ray& r) : origin(r.origin), inv_direction(real(1) / r.direction)
+  {
+    for (int axis = 0; axis < 3; axis++) {
+      near[axis] = (inv_direction[axis] >= 0.0f) ? axis : axis + 3;
+      far[axis] = (inv_direction[axis] >= 0.0f) ? axis + 3 : axis;
+    }
+  }
+};
+
+#if PT_SSE2
+static inline __m128 load_cells(const uint8_t row[4])
+{
+  int32_t packed;
+  std::memcpy(&packed, row, sizeof(packed));
+  __m128i zero = _mm_setzero_si128();
+  __m128i cells = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+  return _mm_cvtepi32_ps(cells);
+}
+#endif
+
+// Test the ray against the four child boxes, returns a bit mask of the children that were hit. The ray is
+// moved into the grid of the node, so a plane at cell q is hit at t = q * scale / d + (origin - o) / d.
+static int intersect_children(const QBVH::Node& node, const RayQBVH& r, float t_min, float t_max, float t_entry[4])
+{
+#if PT_SSE2
+  __m128 t_near = _mm_set1_ps(t_min);
+  __m128 t_far = _mm_set1_ps(t_max);
+
+  for (int axis = 0; axis < 3; axis++) {
+    __m128 a = _mm_set1_ps(exp2i(node.exponent[axis]) * r.inv_direction[axis]);
+    __m128 b = _mm_set1_ps((node.origin[axis] - r.origin[axis]) * r.inv_direction[axis]);
+    __m128 t0 = _mm_add_ps(_mm_mul_ps(load_cells(node.bounds[r.near[axis]]), a), b);
+    __m128 t1 = _mm_add_ps(_mm_mul_ps(load_cells(node.bounds[r.far[axis]]), a), b);
+    t_near = _mm_max_ps(t0, t_near);
+    t_far = _mm_min_ps(t1, t_far);
+  }
+
+  _mm_storeu_ps(t_entry, t_near);
+  return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & node.meta & 0xF;
+#else
+  int mask = 0;
+  for (int i = 0; i < 4; i++) {
+    float t_near = t_min, t_far = t_max;
+    for (int axis = 0; axis < 3; axis++) {
+      float a = exp2i(node.exponent[axis]) * r.inv_direction[axis];
+      float b = (node.origin[axis] - r.origin[axis]) * r.inv_direction[axis];
+      float t0 = float(node.bounds[r.near[axis]][i]) * a + b;
+      float t1 = float(node.bounds[r.far[axis]][i]) * a + b;
+      t_near = std::max(t0, t_near);
+      t_far = std::min(t1, t_far);
+    }
+    t_entry[i] = t_near;
+    if (t_near <= t_far) mask |= 1 << i;
+  }
+  return mask & node.meta & 0xF;
+#endif
+}
+
+QBVH::QBVH(const BVH& bvh) : m_bvh(bvh)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  m_nodes.reserve(m_bvh.node_count() / 3 + 1);
+  m_indices.reserve(m_bvh.indices().size());
+  m_nodes.emplace_back();
+  if (!m_bvh.primitives().empty()) collapse(0, 0);
+  m_nodes.shrink_to_fit();
+
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> duration = end - start;
+
+  size_t primitives = std::max(m_bvh.primitives().size(), size_t(1));
+  std::cout << "QBVH Nodes: " << node_count() << ", Bytes/Primitive: " << double(memory()) / double(primitives)
+            << ", Collapse time: " << duration.count() << " ms" << std::endl;
+}
+
+static double area(const BVH::Node& node)
+{
+  glm::vec3 s = node.max - node.min;
+  return 2.0 * (s.x * s.y + s.y * s.z + s.z * s.x);
+}
+
+// Fill the node at index with up to four descendants of the binary node, the interior ones are placed
+// next to each other at the end of the node array and filled afterwards.
+void QBVH::collapse(uint32_t binary_index, uint32_t index)
+{
+  const auto& nodes = m_bvh.nodes();
+  const auto& indices = m_bvh.indices();
+  const BVH::Node& binary = nodes[binary_index];
+
+  uint32_t children[4] = {binary_index};
+  int child_count = 1;
+
+  if (!binary.is_leaf()) {
+    children[0] = binary.offset;
+    children[1] = binary.offset + 1;
+    child_count = 2;
+  }
+
+  // open the interior child with the largest surface area until there are four children
+  while (child_count < 4) {
+    int best = -1;
+    double best_area = -1.0;
+    for (int i = 0; i < child_count; i++) {
+      const BVH::Node& child = nodes[children[i]];
+      if (!child.is_leaf() && area(child) > best_area) {
+        best = i;
+        best_area = area(child);
+      }
+    }
+    if (best < 0) break;
+
+    uint32_t opened = children[best];
+    children[best] = nodes[opened].offset;
+    children[child_count++] = nodes[opened].offset + 1;
+  }
+
+  Node node = {};
+  for (int axis = 0; axis < 3; axis++) {
+    node.origin[axis] = binary.min[axis];
+    node.exponent[axis] = grid_exponent(binary.min[axis], binary.max[axis]);
+  }
+
+  node.child_base = uint32_t(m_nodes.size());
+  node.primitive_base = uint32_t(m_indices.size());
+
+  uint32_t interior[4];
+  int interior_count = 0;
+
+  for (int i = 0; i < child_count; i++) {
+    const BVH::Node& child = nodes[children[i]];
+    node.meta |= 1 << i;
+
+    for (int axis = 0; axis < 3; axis++) {
+      float scale = exp2i(node.exponent[axis]);
+      node.bounds[axis][i] = quantize_down(child.min[axis], node.origin[axis], scale);
+      node.bounds[axis + 3][i] = quantize_up(child.max[axis], node.origin[axis], scale);
+    }
+
+    if (child.is_leaf()) {
+      assert(child.count <= max_leaf_size);
+      node.count[i] = uint8_t(child.count);
+      m_indices.insert(m_indices.end(), indices.begin() + child.offset, indices.begin() + child.offset + child.count);
+    } else {
+      node.meta |= 1 << (4 + i);
+      interior[interior_count++] = children[i];
+    }
+  }
+
+  // unused slots get an empty box, they are masked out anyway
+  for (int i = child_count; i < 4; i++) {
+    for (int axis = 0; axis < 3; axis++) {
+      node.bounds[axis][i] = 255;
+      node.bounds[axis + 3][i] = 0;
+    }
+  }
+
+  m_nodes[index] = node;
+  m_nodes.resize(m_nodes.size() + interior_count);
+
+  for (int i = 0; i < interior_count; i++) {
+    collapse(interior[i], node.child_base + i);
+  }
+}
+
+std::optional<Hit> QBVH::traverse(const Ray& ray) const
+{
+  const RayQBVH r(ray);
+  const auto& primitives = m_bvh.primitives();
+
+  real t_max = 1e9;
+  float t_max_box = float(t_max);
+
+  std::optional<Hit> result = std::nullopt;
+
+  // interior nodes have count 0, leaves are the range [index, index + count) of the index list
+  struct Entry {
+    uint32_t index;
+    uint32_t count;
+    float t_entry;
+  };
+
+  Entry stack[stack_size];
+  size_t stack_top = 0;
+  stack[stack_top++] = {0, 0, 0.0f};
+  uint64_t visits = 0;
+
+  while (stack_top > 0) {
+    Entry entry = stack[--stack_top];
+    if (entry.t_entry > t_max_box) continue;
+
+    if (entry.count > 0) {
+      for (uint32_t i = entry.index; i < entry.index + entry.count; i++) {
+        auto hit = primitives[m_indices[i]].intersect(ray, t_max);
+        if (hit.has_value()) {
+          result = hit;
+          t_max = hit->t;
+        }
+      }
+      t_max_box = std::nextafter(float(t_max), std::numeric_limits<float>::max());
+      continue;
+    }
+
+    const Node& node = m_nodes[entry.index];
+    visits++;
+
+    float t_entry[4];
+    int mask = intersect_children(node, r, float(ray_epsilon), t_max_box, t_entry);
+
+    // push the hit children sorted by entry distance, so the nearest one is popped first
+    Entry hits[4];
+    int hit_count = 0;
+    uint32_t child = node.child_base, primitive = node.primitive_base;
+
+    for (int i = 0; i < 4; i++) {
+      bool is_interior = node.meta & (1 << (4 + i));
+      if (mask & (1 << i)) {
+        Entry e = is_interior ? Entry{child, 0, t_entry[i]} : Entry{primitive, node.count[i], t_entry[i]};
+        int j = hit_count++;
+        while (j > 0 && hits[j - 1].t_entry < e.t_entry) {
+          hits[j] = hits[j - 1];
+          j--;
+        }
+        hits[j] = e;
+      }
+      child += is_interior;
+      primitive += node.count[i];
+    }
+
+    for (int i = 0; i < hit_count; i++) {
+      if (hits[i].count == 0) prefetch(&m_nodes[hits[i].index]);
+      stack[stack_top++] = hits[i];
+    }
+  }
+
+  count_ray(visits);
+  return result;
+}
+
+bool QBVH::occluded(const Ray& ray, real t_max) const
+{
+  const RayQBVH r(ray);
+  const auto& primitives = m_bvh.primitives();
+  const float t_max_box = std::nextafter(float(t_max), std::numeric_limits<float>::max());
+
+  uint32_t stack[stack_size];
+  size_t stack_top = 0;
+  stack[stack_top++] = 0;
+  uint64_t visits = 0;
+
+  while (stack_top > 0) {
+    const Node& node = m_nodes[stack[--stack_top]];
+    visits++;
+
+    float t_entry[4];
+    int mask = intersect_children(node, r, float(ray_epsilon), t_max_box, t_entry);
+    uint32_t child = node.child_base, primitive = node.primitive_base;
+
+    for (int i = 0; i < 4; i++) {
+      bool is_interior = node.meta & (1 << (4 + i));
+
+      if (mask & (1 << i)) {
+        if (is_interior) {
+          stack[stack_top++] = child;
+        } else {
+          for (uint32_t p = primitive; p < primitive + node.count[i]; p++) {
+            if (primitives[m_indices[p]].occludes(ray, t_max)) {
+              count_ray(visits);
+              return true;
+            }
+          }
+        }
+      }
+
+      child += is_interior;
+      primitive += node.count[i];
+    }
+  }
+
+  count_ray(visits);
+  return false;
+}
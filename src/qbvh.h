@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "accelerator.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "util.h"
+
+// Compressed 4-wide BVH collapsed from a binary BVH. Each node stores the bounds of its four children as
+// 8 bit offsets in a grid spanned by the node box, with a power of two cell size per axis so decoding is
+// exact. Bounds are rounded outwards, so a quantized box always contains the original one. All interior
+// children of a node are stored next to each other, as are the primitive indices of all leaf children, so
+// a node only needs one base index for each.
+class QBVH : public Accelerator
+{
+ public:
+
+  struct Node {
+    float origin[3];          // lower corner of the quantization grid
+    int8_t exponent[3];       // grid cells are 2^exponent wide
+    uint8_t meta;             // bits 0-3: child slot is used, bits 4-7: child is an interior node
+    uint8_t bounds[6][4];     // rows 0..2 min, rows 3..5 max x, y, z of the four children in grid cells
+    uint32_t child_base;      // index of the first interior child
+    uint32_t primitive_base;  // first entry in the index list used by the leaf children
+    uint8_t count[4];         // number of primitives of each leaf child
+  };
+
+  static_assert(sizeof(Node) == 52);
+
+  // leaves are collapsed as they are, their primitive count has to fit Node::count
+  static constexpr size_t max_leaf_size = 255;
+
+  // the leaves of the BVH must not hold more than max_leaf_size primitives
+  QBVH(const BVH&);
+  std::optional<Hit> traverse(const Ray&) const override;
+  bool occluded(const Ray&, real t_max) const override;
+  const AABB& bounds() const override { return m_bvh.bounds(); }
+  size_t node_count() const { return m_nodes.size(); }
+  // bytes of nodes and index list
+  size_t memory() const { return m_nodes.capacity() * sizeof(Node) + m_indices.capacity() * sizeof(uint32_t); }
+
+ private:
+
+  // every visited node pushes at most 3 more entries than it pops
+  static constexpr size_t stack_size = 4 * BVH::max_depth;
+
+  const BVH& m_bvh;
+  std::vector<Node> m_nodes;
+  std::vector<uint32_t> m_indices;
+
+  void collapse(uint32_t binary_index, uint32_t index);
+};
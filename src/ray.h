@@ -1,9 +1,45 @@
 #pragma once
 
+#include <bit>
+#include <cmath>
+#include <cstdint>
 #include <glm/glm.hpp>
 
+#include "real.h"
+
 struct Ray {
-  glm::dvec3 origin;
-  glm::dvec3 direction;
-  inline glm::dvec3 point_at(double t) const { return origin + direction * t; }
-};
\ No newline at end of file
+  rvec3 origin;
+  rvec3 direction;
+  inline rvec3 point_at(real t) const { return origin + direction * t; }
+};
+
+// single precision copy of a ray with the reciprocal direction precomputed for slab tests
+struct RayInv {
+  glm::vec3 origin;
+  glm::vec3 inv_direction;
+  RayInv(const Ray& r) : origin(r.origin), inv_direction(real(1) / r.direction) {}
+};
+
+// Start of a ray leaving a surface at point, moved off the surface along the normal of the side the ray
+// leaves to. The offset is a fixed number of units in the last place, so it covers the rounding error of
+// the hit point at any distance from the origin. Wachter and Binder, "A Fast and Robust Method for Avoiding
+// Self-Intersection", Ray Tracing Gems 2019.
+inline rvec3 offset_ray_origin(const rvec3& point, const rvec3& normal)
+{
+#if PT_DOUBLE_PRECISION
+  // ray_epsilon is far above the rounding error of double precision hit points
+  (void)normal;
+  return point;
+#else
+  constexpr float origin = 1.0f / 32.0f, float_scale = 1.0f / 65536.0f, int_scale = 256.0f;
+  rvec3 offset;
+  for (int axis = 0; axis < 3; axis++) {
+    const float p = point[axis];
+    const int32_t ulps = int32_t(int_scale * normal[axis]);
+    const float moved = std::bit_cast<float>(std::bit_cast<int32_t>(p) + (p < 0.0f ? -ulps : ulps));
+    // close to zero the units in the last place get too small, move by a fixed distance instead
+    offset[axis] = (std::abs(p) < origin) ? p + float_scale * normal[axis] : moved;
+  }
+  return offset;
+#endif
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "config.h"
+
+// Scalar and vector types of the geometry and traversal code: rays, bounds, primitives and the accelerators.
+// Shading stays in double precision and converts at the hit.
+#if PT_DOUBLE_PRECISION
+using real = double;
+#else
+using real = float;
+#endif
+
+using rvec2 = glm::vec<2, real>;
+using rvec3 = glm::vec<3, real>;
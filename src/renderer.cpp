@@ -4,6 +4,10 @@
 #include "config.h"
 #include "util.h"
 #include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
 
 std::atomic<uint64_t> bounce_counter = 0;
 
@@ -16,16 +20,30 @@ static glm::u8vec3 map_pixel(const glm::dvec3 color)
 
 static glm::dvec3 normal_as_color(const glm::dvec3& N) { return 0.5 * glm::dvec3(N.x + 1, N.y + 1, N.z + 1); }
 
-Renderer::Renderer(Camera* camera, Scene* scene, int max_bounce)
+Renderer::Renderer(Camera* camera, Scene* scene, int max_bounce, int packet_size, Integrator integrator,
+                   bool sort_rays)
     : m_camera(camera),
       m_scene(scene),
       m_buffer(camera->width() * camera->height(), glm::dvec3(0.0)),
-      m_max_bounce(max_bounce)
+      m_max_bounce(max_bounce),
+      m_packet_size(glm::clamp(packet_size, 1, 8)),
+      m_integrator(integrator),
+      m_sort_rays(sort_rays)
 {
 }
 
 void Renderer::render(int samples, bool print_progress)
 {
+  if (m_integrator == Integrator::WAVEFRONT) {
+    render_wavefront(samples, print_progress);
+    return;
+  }
+
+  if (m_packet_size > 1 && m_max_bounce > 0) {
+    render_packets(samples, print_progress);
+    return;
+  }
+
   double sample_weight = 1.0 / double(samples);
 
 #pragma omp parallel for schedule(dynamic, 1)
@@ -51,24 +69,409 @@ void Renderer::render(int samples, bool print_progress)
   total_samples += samples;
 }
 
+// The image is rendered in square blocks of pixels. The camera rays of a block are traversed as one packet,
+// the rest of each path is traced ray by ray.
+void Renderer::render_packets(int samples, bool print_progress)
+{
+  const int size = m_packet_size;
+  const int rows = (m_camera->height() + size - 1) / size;
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int row = 0; row < rows; row++) {
+    if (print_progress) {
+      printf("Progress: %.2f%%\n", (double(row) / double(rows)) * 100.0);
+    }
+
+    RayPacket packet;
+    std::optional<Hit> hits[RayPacket::max_size];
+    const int y0 = row * size, y1 = std::min(y0 + size, m_camera->height());
+
+    for (int x0 = 0; x0 < m_camera->width(); x0 += size) {
+      const int x1 = std::min(x0 + size, m_camera->width());
+
+      for (int s = 0; s < samples; s++) {
+        packet.clear();
+        for (int y = y0; y < y1; y++) {
+          for (int x = x0; x < x1; x++) packet.add(m_camera->get_ray(x, y));
+        }
+
+        set_ray_type(RayType::CAMERA);
+        m_scene->find_intersections(packet, hits);
+
+        size_t lane = 0;
+        for (int y = y0; y < y1; y++) {
+          for (int x = x0; x < x1; x++, lane++) {
+            int i = y * m_camera->width() + x;
+            auto color = shade(packet.rays[lane], hits[lane], 0, false);
+            m_buffer[i] = glm::mix(m_buffer[i], color, 1.0 / double(total_samples + s + 1));
+          }
+        }
+      }
+    }
+  }
+
+  total_samples += samples;
+}
+
+
 // https://en.wikipedia.org/wiki/Grayscale#Luma_coding_in_video_systems
+// origin of a ray leaving the surface in direction, moved off the surface on the side the ray leaves from
+static rvec3 leaving_origin(const Intersection& surface, const glm::dvec3& direction)
+{
+  const glm::dvec3& n = surface.geometric_normal;
+  glm::dvec3 normal = glm::dot(direction, n) >= 0.0 ? n : -n;
+  return offset_ray_origin(surface.point, normal);
+}
+
 static double luma(const glm::dvec3& color) { return glm::dot(color, glm::dvec3(0.2126, 0.7152, 0.0722)); }
 
+// number of paths advanced together by the wavefront integrator
+constexpr size_t wavefront_size = size_t(1) << 14;
+
+// state of the live paths of one wavefront in structure of arrays form, indexed by path
+struct PathStates {
+  std::vector<uint32_t> sample;  // pixel sample the path belongs to
+  std::vector<Ray> ray;          // next ray to trace
+  std::vector<glm::dvec3> throughput;
+  std::vector<uint8_t> perfect_reflection;
+
+  void resize(size_t count)
+  {
+    sample.resize(count);
+    ray.resize(count);
+    throughput.resize(count);
+    perfect_reflection.resize(count);
+  }
+};
+
+// shadow rays queued by the shading stage, their contribution is added unless something blocks them
+struct ShadowRays {
+  std::vector<uint32_t> sample;
+  std::vector<Ray> ray;
+  std::vector<double> t_max;
+  std::vector<glm::dvec3> contribution;
+
+  void resize(size_t count)
+  {
+    sample.resize(count);
+    ray.resize(count);
+    t_max.resize(count);
+    contribution.resize(count);
+  }
+};
+
+// material types are single bits, their bit index orders the shading queue
+static size_t material_bucket(const Material* material) { return std::countr_zero(uint32_t(material->type)); }
+
+constexpr size_t material_bucket_count = 8;
+
+// spread the lower 21 bits so that two zero bits follow each of them
+static uint64_t spread_bits3(uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffff;
+  v = (v | v << 16) & 0x1f0000ff0000ff;
+  v = (v | v << 8) & 0x100f00f00f00f00f;
+  v = (v | v << 4) & 0x10c30c30c30c30c3;
+  v = (v | v << 2) & 0x1249249249249249;
+  return v;
+}
+
+// spread the lower 16 bits so that a zero bit follows each of them
+static uint64_t spread_bits2(uint64_t v)
+{
+  v &= 0xffff;
+  v = (v | v << 8) & 0x00ff00ff;
+  v = (v | v << 4) & 0x0f0f0f0f;
+  v = (v | v << 2) & 0x33333333;
+  v = (v | v << 1) & 0x55555555;
+  return v;
+}
+
+// Sort key of a ray, the Morton code of its origin quantized in the scene bounds followed by the Morton code
+// of its direction in octahedral mapping. Rays with nearby origins and similar directions get close keys.
+static uint64_t ray_key(const Ray& ray, const glm::dvec3& scene_min, const glm::dvec3& scene_extent)
+{
+  constexpr int origin_bits = 14, direction_bits = 11;
+
+  glm::dvec3 o = glm::clamp((glm::dvec3(ray.origin) - scene_min) / scene_extent, 0.0, 1.0);
+  uint32_t origin[3];
+  for (int axis = 0; axis < 3; axis++) origin[axis] = uint32_t(o[axis] * double((1 << origin_bits) - 1));
+
+  glm::dvec3 d = glm::dvec3(ray.direction) /
+                 double(std::abs(ray.direction.x) + std::abs(ray.direction.y) + std::abs(ray.direction.z));
+  glm::dvec2 uv(d.x, d.y);
+  if (d.z < 0.0) {
+    uv = glm::dvec2((1.0 - std::abs(d.y)) * (d.x >= 0.0 ? 1.0 : -1.0),
+                    (1.0 - std::abs(d.x)) * (d.y >= 0.0 ? 1.0 : -1.0));
+  }
+  uv = glm::clamp(uv * 0.5 + 0.5, 0.0, 1.0);
+  uint32_t direction[2] = {uint32_t(uv.x * double((1 << direction_bits) - 1)),
+                           uint32_t(uv.y * double((1 << direction_bits) - 1))};
+
+  uint64_t origin_code = (spread_bits3(origin[0]) << 2) | (spread_bits3(origin[1]) << 1) | spread_bits3(origin[2]);
+  uint64_t direction_code = (spread_bits2(direction[0]) << 1) | spread_bits2(direction[1]);
+  return (origin_code << (2 * direction_bits)) | direction_code;
+}
+
+// order the slots by the sort key of their rays
+static void sort_by_ray(std::vector<uint32_t>& order, const std::vector<Ray>& rays, const glm::dvec3& scene_min,
+                        const glm::dvec3& scene_extent, std::vector<std::pair<uint64_t, uint32_t>>& keys)
+{
+  const int64_t count = int64_t(order.size());
+  keys.resize(count);
+
+#pragma omp parallel for
+  for (int64_t k = 0; k < count; k++) keys[k] = {ray_key(rays[order[k]], scene_min, scene_extent), order[k]};
+
+  std::sort(keys.begin(), keys.end());
+  for (int64_t k = 0; k < count; k++) order[k] = keys[k].second;
+}
+
+// The wavefront integrator renders a few rows at a time. All samples of their pixels start as paths that
+// advance one bounce per iteration through the stages intersect, sort by material, shade and trace shadow
+// rays. Each stage is a loop over the live paths, and shading all paths of one material type together
+// keeps the BxDF branches predictable. The paths that continue are compacted for the next bounce, in
+// shading order or sorted by their rays. The paths take the same decisions as trace_ray, only in a
+// different order, so both integrators converge to the same image.
+void Renderer::render_wavefront(int samples, bool print_progress)
+{
+  const int width = m_camera->width(), height = m_camera->height();
+  const int rows = std::max(1, int(wavefront_size / size_t(width * samples)));
+  const size_t capacity = size_t(std::min(rows, height)) * width * samples;
+
+  PathStates paths, next;
+  ShadowRays shadows;
+  paths.resize(capacity);
+  next.resize(capacity);
+  shadows.resize(capacity);
+
+  std::vector<std::optional<Hit>> hits(capacity);
+  std::vector<glm::dvec3> radiance(capacity);
+  std::vector<uint8_t> alive(capacity), has_shadow_ray(capacity);
+  std::vector<uint32_t> queue, order;
+  std::vector<std::pair<uint64_t, uint32_t>> keys;
+  std::array<size_t, material_bucket_count + 1> buckets;
+
+  const glm::dvec3 scene_extent = glm::max(m_scene->size(), glm::dvec3(1e-9));
+  const glm::dvec3 scene_min = m_scene->center() - 0.5 * scene_extent;
+
+  for (int y0 = 0; y0 < height; y0 += rows) {
+    if (print_progress) {
+      printf("Progress: %.2f%%\n", (double(y0) / double(height)) * 100.0);
+    }
+
+    const int y1 = std::min(y0 + rows, height);
+    const int64_t count = int64_t(y1 - y0) * width * samples;
+
+    // generate, the samples of a pixel are consecutive
+#pragma omp parallel for
+    for (int64_t i = 0; i < count; i++) {
+      int pixel = y0 * width + int(i / samples);
+      paths.sample[i] = uint32_t(i);
+      paths.ray[i] = m_camera->get_ray(pixel % width, pixel / width);
+      paths.throughput[i] = glm::dvec3(1.0);
+      paths.perfect_reflection[i] = false;
+      radiance[i] = glm::dvec3(0.0);
+    }
+
+    int64_t path_count = count;
+
+    for (int depth = 0; depth < m_max_bounce && path_count > 0; depth++) {
+      // intersect, paths leaving the scene pick up the background
+      const RayType ray_type = depth == 0 ? RayType::CAMERA : RayType::INDIRECT;
+      auto trace_start = std::chrono::high_resolution_clock::now();
+
+#pragma omp parallel for schedule(dynamic, 256)
+      for (int64_t i = 0; i < path_count; i++) {
+        // the ray type is per thread, so every worker sets it
+        set_ray_type(ray_type);
+        bounce_counter++;
+        hits[i] = m_scene->find_intersection(paths.ray[i]);
+
+        if (!hits[i].has_value()) {
+          radiance[paths.sample[i]] += paths.throughput[i] * m_scene->sample_background(paths.ray[i]);
+        }
+      }
+
+      if (depth > 0) {
+        std::chrono::duration<double, std::milli> duration = std::chrono::high_resolution_clock::now() - trace_start;
+        m_trace_time += duration.count();
+        m_secondary_rays += path_count;
+      }
+
+      // sort the hits by material type with a counting sort
+      buckets.fill(0);
+      for (int64_t i = 0; i < path_count; i++) {
+        if (hits[i].has_value()) buckets[material_bucket(hits[i]->primitive->material) + 1]++;
+      }
+      for (size_t b = 1; b < buckets.size(); b++) buckets[b] += buckets[b - 1];
+
+      queue.resize(buckets.back());
+      for (int64_t i = 0; i < path_count; i++) {
+        if (hits[i].has_value()) queue[buckets[material_bucket(hits[i]->primitive->material)]++] = uint32_t(i);
+      }
+
+      // shade, a path that continues writes its next state and shadow ray to its slot in the queue
+      const int64_t queue_count = int64_t(queue.size());
+#pragma omp parallel for schedule(dynamic, 256)
+      for (int64_t q = 0; q < queue_count; q++) {
+        uint32_t i = queue[q];
+        const Ray& ray = paths.ray[i];
+        const Intersection surface = m_scene->resolve_hit(ray, *hits[i]);
+        const uint32_t sample = paths.sample[i];
+        Material* material = surface.material;
+        glm::dvec3 throughput = paths.throughput[i];
+        alive[q] = false;
+        has_shadow_ray[q] = false;
+
+#if PT_DEBUG_NORMAL
+        radiance[sample] += throughput * normal_as_color(surface.normal);
+        continue;
+#endif
+
+#if PT_RUSSIAN_ROULETTE
+        int min_depth = 3;
+
+        if (min_depth < depth) {
+          double rr_prob = luma(surface.albedo);
+          if (random_double() >= rr_prob) {
+            radiance[sample] += throughput * material->emission;
+            continue;
+          } else {
+            throughput /= rr_prob;
+          }
+        }
+#endif
+
+        glm::mat3 local2world = local_to_world(surface.normal);
+        glm::mat3 world2local = glm::inverse(local2world);
+
+        BxDF brdf(&surface);
+
+        glm::dvec3 wo = world2local * -glm::dvec3(ray.direction);
+        glm::dvec3 wi = brdf.sample(wo);
+
+        bool perfectly_specular = material->is_perfectly_specular();
+
+#if PT_DIRECT_LIGHT_SAMPLING
+        if (depth == 0 || perfectly_specular || paths.perfect_reflection[i])
+#endif
+        {
+          radiance[sample] += throughput * material->emission;
+        }
+
+#if PT_DIRECT_LIGHT_SAMPLING
+        if (!perfectly_specular) {
+          auto light = sample_light(surface, brdf, glm::dvec3(ray.direction));
+          if (light.has_value()) {
+            has_shadow_ray[q] = true;
+            shadows.sample[q] = sample;
+            shadows.ray[q] = light->shadow_ray;
+            shadows.t_max[q] = light->t_max;
+            shadows.contribution[q] = throughput * light->contribution;
+          }
+        }
+#endif
+
+#if PT_INDIRECT_LIGHT_SAMPLING
+        alive[q] = depth + 1 < m_max_bounce;
+        next.sample[q] = sample;
+        glm::dvec3 direction = local2world * wi;
+        next.ray[q] = Ray(leaving_origin(surface, direction), direction);
+        next.throughput[q] = throughput * brdf.eval(wo, wi);
+        next.perfect_reflection[q] = perfectly_specular;
+#endif
+      }
+
+      // trace the shadow rays
+      order.clear();
+      for (int64_t q = 0; q < queue_count; q++) {
+        if (has_shadow_ray[q]) order.push_back(uint32_t(q));
+      }
+
+      if (m_sort_rays) {
+        auto sort_start = std::chrono::high_resolution_clock::now();
+        sort_by_ray(order, shadows.ray, scene_min, scene_extent, keys);
+        std::chrono::duration<double, std::milli> duration = std::chrono::high_resolution_clock::now() - sort_start;
+        m_sort_time += duration.count();
+      }
+
+      const int64_t shadow_count = int64_t(order.size());
+      trace_start = std::chrono::high_resolution_clock::now();
+
+#pragma omp parallel for schedule(dynamic, 256)
+      for (int64_t k = 0; k < shadow_count; k++) {
+        set_ray_type(RayType::SHADOW);
+        uint32_t q = order[k];
+        if (!m_scene->occluded(shadows.ray[q], shadows.t_max[q])) {
+          radiance[shadows.sample[q]] += shadows.contribution[q];
+        }
+      }
+
+      std::chrono::duration<double, std::milli> duration = std::chrono::high_resolution_clock::now() - trace_start;
+      m_trace_time += duration.count();
+      m_secondary_rays += shadow_count;
+
+      // compact the paths that continue, the shading order keeps paths of the same material together
+      order.clear();
+      for (int64_t q = 0; q < queue_count; q++) {
+        if (alive[q]) order.push_back(uint32_t(q));
+      }
+
+      if (m_sort_rays) {
+        auto sort_start = std::chrono::high_resolution_clock::now();
+        sort_by_ray(order, next.ray, scene_min, scene_extent, keys);
+        std::chrono::duration<double, std::milli> duration = std::chrono::high_resolution_clock::now() - sort_start;
+        m_sort_time += duration.count();
+      }
+
+      path_count = int64_t(order.size());
+      for (int64_t i = 0; i < path_count; i++) {
+        uint32_t q = order[i];
+        paths.sample[i] = next.sample[q];
+        paths.ray[i] = next.ray[q];
+        paths.throughput[i] = next.throughput[q];
+        paths.perfect_reflection[i] = next.perfect_reflection[q];
+      }
+    }
+
+    // accumulate in sample order, like the recursive integrator
+#pragma omp parallel for
+    for (int64_t p = 0; p < count / samples; p++) {
+      int pixel = y0 * width + int(p);
+      glm::dvec3 result = m_buffer[pixel];
+      for (int s = 0; s < samples; s++) {
+        result = glm::mix(result, radiance[p * samples + s], 1.0 / double(total_samples + s + 1));
+      }
+      m_buffer[pixel] = result;
+    }
+  }
+
+  total_samples += samples;
+}
+
 glm::dvec3 Renderer::trace_ray(const Ray& ray, int depth, bool perfect_reflection)
 {
   if (m_max_bounce <= depth) {
     return glm::vec3(0);
   }
 
-  bounce_counter++;
+  set_ray_type(depth == 0 ? RayType::CAMERA : RayType::INDIRECT);
+  return shade(ray, m_scene->find_intersection(ray), depth, perfect_reflection);
+}
 
-  auto possible_hit = m_scene->find_intersection(ray);
+// radiance leaving the closest hit of a traced ray towards its origin
+glm::dvec3 Renderer::shade(const Ray& ray, const std::optional<Hit>& possible_hit, int depth,
+                           bool perfect_reflection)
+{
+  bounce_counter++;
 
   if (!possible_hit.has_value()) {
     return m_scene->sample_background(ray);
   }
 
-  Intersection surface = possible_hit.value();
+  Intersection surface = m_scene->resolve_hit(ray, possible_hit.value());
   Material* material = surface.material;
 
 #if PT_DEBUG_NORMAL
@@ -81,7 +484,7 @@ glm::dvec3 Renderer::trace_ray(const Ray& ray, int depth, bool perfect_reflectio
   int min_depth = 3;
 
   if (min_depth < depth) {
-    double rr_prob = luma(surface.albedo());
+    double rr_prob = luma(surface.albedo);
     if (random_double() >= rr_prob) {
       return surface.material->emission;
     } else {
@@ -97,7 +500,7 @@ glm::dvec3 Renderer::trace_ray(const Ray& ray, int depth, bool perfect_reflectio
 
   BxDF brdf(&surface);
 
-  glm::dvec3 wo = world2local * (-ray.direction);
+  glm::dvec3 wo = world2local * -glm::dvec3(ray.direction);
   glm::dvec3 wi = brdf.sample(wo);
 
   glm::dvec3 radiance(0.0);
@@ -113,61 +516,90 @@ glm::dvec3 Renderer::trace_ray(const Ray& ray, int depth, bool perfect_reflectio
 
 #if PT_DIRECT_LIGHT_SAMPLING
   if (!perfectly_specular) {
-    radiance += sample_lights(surface.point, brdf, ray.direction, surface.id);
+    radiance += sample_lights(surface, brdf, glm::dvec3(ray.direction));
   }
 #endif
 
 #if PT_INDIRECT_LIGHT_SAMPLING
-  Ray outgoing(surface.point, local2world * wi);
+  glm::dvec3 direction = local2world * wi;
+  Ray outgoing(leaving_origin(surface, direction), direction);
   radiance += trace_ray(outgoing, depth + 1, perfectly_specular) * brdf.eval(wo, wi);
 #endif
 
   return radiance * rr_weight;
 }
 
+void Renderer::print_stats() const
+{
+  if (m_secondary_rays == 0) return;
+
+  std::cout << "Secondary Rays: " << m_secondary_rays << ", Trace Time: " << m_trace_time
+            << " ms, Sort Time: " << m_sort_time << " ms" << std::endl;
+  std::cout << "Secondary Rays/Second: " << double(m_secondary_rays) / (m_trace_time / 1000.0)
+            << ", Including Sorting: " << double(m_secondary_rays) / ((m_trace_time + m_sort_time) / 1000.0)
+            << std::endl;
+}
+
 // https://computergraphics.stackexchange.com/questions/5152/progressive-path-tracing-with-explicit-light-sampling
 // https://computergraphics.stackexchange.com/questions/4288/path-weight-for-direct-light-sampling
-glm::dvec3 Renderer::sample_lights(const glm::dvec3& point, const BxDF& bsdf, const glm::dvec3& incoming, uint32_t id)
+glm::dvec3 Renderer::sample_lights(const Intersection& surface, const BxDF& bsdf, const glm::dvec3& incoming)
 {
-  if (m_scene->light_count() == 0) {
+  auto sample = sample_light(surface, bsdf, incoming);
+
+  if (!sample.has_value()) {
     return glm::dvec3(0.0);
   }
 
-  Primitive light = m_scene->random_light();
+  set_ray_type(RayType::SHADOW);
 
-  glm::dvec3 result(0);
+  if (m_scene->occluded(sample->shadow_ray, sample->t_max)) {
+    return glm::dvec3(0.0);
+  }
 
-  glm::dvec3 point_to_light = light.sample_point(point) - point;
-  double distance = glm::length(point_to_light);
-  point_to_light = glm::normalize(point_to_light);
+  return sample->contribution;
+}
 
-  auto record = m_scene->find_intersection(Ray(point, point_to_light));
+std::optional<Renderer::LightSample> Renderer::sample_light(const Intersection& surface, const BxDF& bsdf,
+                                                            const glm::dvec3& incoming) const
+{
+  if (m_scene->light_count() == 0) {
+    return std::nullopt;
+  }
+
+  Primitive light = m_scene->random_light();
 
-  if (record.has_value() && record.value().id == light.id && id != light.id) {
-    Intersection surface = record.value();
+  glm::dvec3 light_point = light.sample_point(surface.point);
+  // measure from the moved origin, so the light is not hit before t_max
+  glm::dvec3 origin = leaving_origin(surface, light_point - surface.point);
+  glm::dvec3 point_to_light = light_point - origin;
+  double distance = glm::length(point_to_light);
+  point_to_light = glm::normalize(point_to_light);
 
-    glm::dvec3 normal = surface.normal;
+  if (surface.id == light.id) {
+    return std::nullopt;
+  }
 
-    glm::mat3 local2world = local_to_world(normal);
-    glm::mat3 world2local = glm::inverse(local2world);
+  glm::dvec3 normal = light.normal(light_point);
 
-    glm::dvec3 wo = world2local * (-incoming);
-    glm::dvec3 wi = world2local * point_to_light;
+  glm::mat3 local2world = local_to_world(normal);
+  glm::mat3 world2local = glm::inverse(local2world);
 
-    double area = light.sample_area();
-    double falloff = 1.0 / sq(distance);
-    double light_cos_theta = glm::max(glm::dot(normal, -point_to_light), 0.0);
+  glm::dvec3 wo = world2local * (-incoming);
+  glm::dvec3 wi = world2local * point_to_light;
 
-    double weight = area * falloff * light_cos_theta;
+  double area = light.sample_area();
+  double falloff = 1.0 / sq(distance);
+  double light_cos_theta = glm::max(glm::dot(normal, -point_to_light), 0.0);
 
-    double light_pdf = 1.0 / double(m_scene->light_count());
+  double weight = area * falloff * light_cos_theta;
 
-    glm::dvec3 emission = light.material->emission;
+  double light_pdf = 1.0 / double(m_scene->light_count());
 
-    result += (emission * weight * bsdf.eval(wo, wi)) / light_pdf;
-  }
+  glm::dvec3 emission = light.material->emission;
 
-  return result;
+  // stop just before the light, otherwise the light itself would count as a blocker
+  return LightSample{Ray(origin, point_to_light), distance - ray_epsilon,
+                     (emission * weight * bsdf.eval(wo, wi)) / light_pdf};
 }
 
 // Narkowicz 2015, "ACES Filmic Tone Mapping Curve"
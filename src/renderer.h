@@ -12,12 +12,21 @@
 
 #include "scene.h"
 
+// RECURSIVE traces each path to its end before starting the next one, WAVEFRONT advances a large batch of
+// paths one bounce at a time
+enum class Integrator : uint8_t { RECURSIVE, WAVEFRONT };
+
 class Renderer
 {
  public:
-  Renderer(Camera *camera, Scene *scene, int max_bounce);
+  // camera rays of packet_size x packet_size pixel blocks are traversed together, 1 traces them one by one.
+  // sort_rays orders the secondary and shadow rays of the wavefront integrator by origin and direction.
+  Renderer(Camera *camera, Scene *scene, int max_bounce, int packet_size = 1,
+           Integrator integrator = Integrator::RECURSIVE, bool sort_rays = false);
   void render(int samples, bool print_progress = false);
   void save_image(const std::filesystem::path &path);
+  // throughput of the secondary and shadow rays traced by the wavefront integrator
+  void print_stats() const;
 
   int total_samples = 0;
 
@@ -26,7 +35,27 @@ class Renderer
   Camera *m_camera;
   std::vector<glm::dvec3> m_buffer;
   int m_max_bounce;
+  int m_packet_size;
+  Integrator m_integrator;
+  bool m_sort_rays;
+
+  // wavefront integrator timings of secondary and shadow rays
+  uint64_t m_secondary_rays = 0;
+  double m_trace_time = 0.0;  // ms
+  double m_sort_time = 0.0;   // ms
+
+  // light sample of a shading point, it only contributes if the shadow ray is not blocked
+  struct LightSample {
+    Ray shadow_ray;
+    double t_max;
+    glm::dvec3 contribution;
+  };
 
+  void render_packets(int samples, bool print_progress);
+  void render_wavefront(int samples, bool print_progress);
   glm::dvec3 trace_ray(const Ray &ray, int depth, bool perfect_reflection = false);
-  glm::dvec3 sample_lights(const glm::dvec3 &point, const BxDF &bsdf, const glm::dvec3 &incoming, uint32_t id);
+  glm::dvec3 shade(const Ray &ray, const std::optional<Hit> &hit, int depth, bool perfect_reflection);
+  glm::dvec3 sample_lights(const Intersection &surface, const BxDF &bsdf, const glm::dvec3 &incoming);
+  std::optional<LightSample> sample_light(const Intersection &surface, const BxDF &bsdf,
+                                          const glm::dvec3 &incoming) const;
 };
\ No newline at end of file
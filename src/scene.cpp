@@ -1,5 +1,6 @@
 
 #include "scene.h"
+#include <algorithm>
 #include <iostream>
 #include "aabb.h"
 #include "geometry.h"
@@ -16,7 +17,26 @@ Scene::Scene() : m_bvh(nullptr), m_background_texture(nullptr), m_background_col
 {
 }
 
-std::optional<Intersection> Scene::find_intersection(const Ray& ray) const { return m_bvh->traverse(ray); }
+const Accelerator& Scene::accelerator() const
+{
+  if (m_tlas) return *m_tlas;
+  return m_accelerator ? *m_accelerator : *m_bvh;
+}
+
+std::optional<Hit> Scene::find_intersection(const Ray& ray) const { return accelerator().traverse(ray); }
+
+void Scene::find_intersections(const RayPacket& packet, std::optional<Hit>* hits) const
+{
+  accelerator().traverse_packet(packet, hits);
+}
+
+Intersection Scene::resolve_hit(const Ray& ray, const Hit& hit) const
+{
+  if (hit.instance != Hit::no_instance) return m_tlas->surface(ray, hit);
+  return hit.primitive->surface(ray, hit.t, hit.barycentrics);
+}
+
+bool Scene::occluded(const Ray& ray, real t_max) const { return accelerator().occluded(ray, t_max); }
 
 static glm::dvec3 sky_gradient(const glm::dvec3& direction)
 {
@@ -28,7 +48,7 @@ void Scene::set_background_texture(std::unique_ptr<Image> texture) { m_backgroun
 
 void Scene::set_background_color(const glm::dvec3& color) { m_background_color = color; }
 
-int Scene::light_count() const { return m_lights.size(); }
+int Scene::light_count() const { return m_lights.size() + m_instance_lights.size(); }
 
 glm::dvec3 Scene::sample_background(const Ray& r) const
 {
@@ -65,30 +85,274 @@ Primitive Scene::random_light() const
 {
   static std::random_device rd;
   static std::mt19937 gen(rd());
-  std::uniform_int_distribution<> distr(0, int(m_lights.size() - 1));
-  int random_index = distr(gen);
-  return m_lights[random_index];
+  std::uniform_int_distribution<> distr(0, light_count() - 1);
+  size_t random_index = size_t(distr(gen));
+  if (random_index < m_lights.size()) return m_lights[random_index];
+  return m_instance_lights[random_index - m_lights.size()];
 }
 
-std::vector<Primitive> Scene::lights() const { return m_lights; }
+std::vector<Primitive> Scene::lights() const
+{
+  std::vector<Primitive> lights = m_lights;
+  lights.insert(lights.end(), m_instance_lights.begin(), m_instance_lights.end());
+  return lights;
+}
 
 void Scene::add_primitives(const std::vector<Primitive>::iterator begin, const std::vector<Primitive>::iterator end)
 {
   for (auto it = begin; it != end; it++) add_primitive(*it);
 }
 
-void Scene::compute_bvh() { m_bvh = std::make_unique<BVH>(m_primitives); }
+void Scene::compute_accelerator(const AcceleratorConfig& config)
+{
+  m_accelerator_config = config;
+  m_accelerator = nullptr;
+  m_bvh = nullptr;
+
+  // the top level of instanced scenes only holds BVHs
+  if (config.type != AcceleratorConfig::BVH && !m_instances.empty()) {
+    std::cout << "Instanced scenes are traced with BVHs, ignoring the accelerator type" << std::endl;
+  }
+
+  if (config.type == AcceleratorConfig::BVH || !m_instances.empty()) {
+    m_bvh = std::make_unique<BVH>(m_primitives, config.bvh);
+    m_bvh->print_statistics();
+    collapse_bvh();
+  } else if (config.type == AcceleratorConfig::KD_TREE) {
+    m_accelerator = std::make_unique<KdTree>(m_primitives, config.kd_tree);
+  } else {
+    m_accelerator = std::make_unique<Grid>(m_primitives, config.grid);
+  }
+
+  m_mesh_bvhs.clear();
+  for (const auto& mesh : m_meshes) {
+    m_mesh_bvhs.push_back(std::make_unique<BVH>(mesh, config.bvh));
+  }
+
+  compute_tlas();
+}
+
+// build the wide BVH the config asks for from the binary one
+void Scene::collapse_bvh()
+{
+  const BVHConfig& config = m_accelerator_config.bvh;
+
+  if (config.lazy && (config.quantized || config.width == 4)) {
+    // the wide BVHs are collapsed from the whole binary tree
+    std::cout << "Lazy BVH renders with the binary BVH, ignoring width and quantized" << std::endl;
+  } else if (config.quantized) {
+    // leaves at the depth limit or without a valid split can still exceed max_leaf_size
+    const auto& nodes = m_bvh->nodes();
+    auto too_large = [](const BVH::Node& node) { return node.is_leaf() && node.count > QBVH::max_leaf_size; };
+    if (std::any_of(nodes.begin(), nodes.end(), too_large)) {
+      std::cout << "BVH has leaves with more than " << QBVH::max_leaf_size
+                << " primitives, rendering with the binary BVH instead of the quantized one" << std::endl;
+    } else {
+      m_accelerator = std::make_unique<QBVH>(*m_bvh);
+    }
+  } else if (config.width == 4) {
+    m_accelerator = std::make_unique<BVH4>(*m_bvh);
+  }
+}
+
+// The primitives that are not instanced become one more instance with an identity transform. The top level
+// is rebuilt from scratch whenever something moves, it only holds one box per instance.
+void Scene::compute_tlas()
+{
+  m_tlas = nullptr;
+  if (m_instances.empty()) return;
+
+  std::vector<const BVH*> meshes;
+  for (const auto& bvh : m_mesh_bvhs) meshes.push_back(bvh.get());
+
+  std::vector<Instance> instances = m_instances;
+  if (!m_primitives.empty()) {
+    meshes.push_back(m_bvh.get());
+    instances.push_back({uint32_t(meshes.size() - 1), glm::dmat4(1.0)});
+  }
+
+  m_tlas = std::make_unique<TLAS>(meshes, instances, m_accelerator_config.bvh);
+}
+
+void Scene::add_instance(const std::filesystem::path& filename, const glm::dmat4& transform)
+{
+  auto it = std::find(m_mesh_paths.begin(), m_mesh_paths.end(), filename);
+  uint32_t mesh = uint32_t(it - m_mesh_paths.begin());
+
+  if (it == m_mesh_paths.end()) {
+    // instanced primitives get ids too, all instances of a model share them
+    std::vector<Primitive> primitives = load_obj(filename);
+    for (Primitive& p : primitives) p.id = m_count++;
+    m_mesh_paths.push_back(filename);
+    m_meshes.push_back(std::move(primitives));
+  }
+
+  m_instances.push_back({mesh, transform});
+  add_instance_lights(m_instances[m_instances.size() - 1]);
+}
+
+void Scene::set_instance_transform(uint32_t instance, const glm::dmat4& transform)
+{
+  m_instances[instance].transform = transform;
+
+  m_instance_lights.clear();
+  m_instance_light_mesh = Mesh();
+  for (const Instance& placed : m_instances) add_instance_lights(placed);
+}
+
+// The emitters of an instance are sampled through world space copies, the triangles get their own vertices
+// in m_instance_light_mesh. The copies keep the id of the primitive in the model, so a surface hit on one
+// instance of an emitter does not sample the same emitter of the other instances either.
+void Scene::add_instance_lights(const Instance& instance)
+{
+  const glm::dmat4& transform = instance.transform;
+  const glm::dmat3 normal_transform = glm::transpose(glm::inverse(glm::dmat3(transform)));
+  Mesh& mesh = m_instance_light_mesh;
+
+  for (const Primitive& p : m_meshes[instance.mesh]) {
+    if (!p.is_light()) continue;
+
+    Primitive light = p;
+    if (p.type == Primitive::TRIANGLE) {
+      for (int corner = 0; corner < 3; corner++) {
+        const Mesh::Index& index = p.triangle.index(corner);
+        const glm::dvec3 n = p.triangle.mesh->normals[index.normal];
+        const uint32_t i = uint32_t(mesh.positions.size());
+        mesh.positions.push_back(glm::dvec3(transform * glm::dvec4(glm::dvec3(p.triangle.vertex(corner)), 1.0)));
+        mesh.normals.push_back(n == glm::dvec3(0.0) ? n : glm::normalize(normal_transform * n));
+        mesh.texcoords.push_back(p.triangle.mesh->texcoords[index.texcoord]);
+        mesh.indices.push_back({i, i, i});
+      }
+      mesh.edges.resize(2 * mesh.face_count());
+      mesh.compute_edges(uint32_t(mesh.face_count() - 1));
+      light.triangle = Triangle(&mesh, uint32_t(mesh.face_count() - 1));
+      light.bbox = AABB(light.triangle);
+    } else {
+      // spheres only support uniform scaling
+      light.sphere.center = glm::dvec3(transform * glm::dvec4(glm::dvec3(p.sphere.center), 1.0));
+      light.sphere.radius *= glm::length(glm::dvec3(transform[0]));
+      light.bbox = AABB(light.sphere);
+    }
+    m_instance_lights.push_back(light);
+  }
+}
+
+int Scene::instance_count() const { return m_instances.size(); }
+
+void Scene::update_accelerator()
+{
+  // only the BVH is refit, a lazy one only builds its top levels which is cheap enough to do again
+  if (!m_bvh || m_accelerator_config.bvh.lazy) {
+    compute_accelerator(m_accelerator_config);
+    return;
+  }
+
+  m_bvh->refit(m_primitives);
+  assert(m_bvh->bounds_valid());
+
+  if (m_bvh->degraded()) {
+    std::cout << "BVH degraded by refitting, rebuilding" << std::endl;
+    compute_accelerator(m_accelerator_config);
+    return;
+  }
+
+  // the wide nodes hold a copy of the binary bounds
+  m_accelerator = nullptr;
+  collapse_bvh();
+
+  compute_tlas();
+}
+
+// Vertices are shared, so every position and normal used by the range is moved once. Vertices the range
+// shares with triangles outside it are copied first and the range's faces point to the copies, so the
+// triangles outside the range and their bounds stay where they are.
+void Scene::transform_primitives(uint32_t begin, uint32_t end, const glm::dmat4& transform)
+{
+  const glm::dmat3 normal_transform = glm::transpose(glm::inverse(glm::dmat3(transform)));
+  auto point = [&transform](const glm::dvec3& p) { return glm::dvec3(transform * glm::dvec4(p, 1.0)); };
+  auto normal = [&normal_transform](const glm::dvec3& n) {
+    // the zero normal of corners without one stays zero
+    return n == glm::dvec3(0.0) ? n : glm::normalize(normal_transform * n);
+  };
+
+  for (const auto& mesh : m_mesh_data) {
+    std::vector<bool> position_kept(mesh->positions.size()), normal_kept(mesh->normals.size());
+    for (uint32_t i = 0; i < m_primitives.size(); i++) {
+      const Primitive& p = m_primitives[i];
+      if ((i >= begin && i < end) || p.type != Primitive::TRIANGLE || p.triangle.mesh != mesh.get()) continue;
+      for (int corner = 0; corner < 3; corner++) {
+        position_kept[p.triangle.index(corner).position] = true;
+        normal_kept[p.triangle.index(corner).normal] = true;
+      }
+    }
+
+    std::vector<uint32_t> position_copy(mesh->positions.size(), UINT32_MAX);
+    std::vector<uint32_t> normal_copy(mesh->normals.size(), UINT32_MAX);
+    std::vector<bool> position_moved(mesh->positions.size()), normal_moved(mesh->normals.size());
+
+    for (uint32_t i = begin; i < end; i++) {
+      const Primitive& p = m_primitives[i];
+      if (p.type != Primitive::TRIANGLE || p.triangle.mesh != mesh.get()) continue;
+
+      for (int corner = 0; corner < 3; corner++) {
+        Mesh::Index& index = mesh->indices[3 * p.triangle.face + corner];
+        if (position_kept[index.position]) {
+          if (position_copy[index.position] == UINT32_MAX) {
+            position_copy[index.position] = uint32_t(mesh->positions.size());
+            mesh->positions.push_back(mesh->positions[index.position]);
+            position_moved.push_back(false);
+          }
+          index.position = position_copy[index.position];
+        }
+        if (normal_kept[index.normal]) {
+          if (normal_copy[index.normal] == UINT32_MAX) {
+            normal_copy[index.normal] = uint32_t(mesh->normals.size());
+            mesh->normals.push_back(mesh->normals[index.normal]);
+            normal_moved.push_back(false);
+          }
+          index.normal = normal_copy[index.normal];
+        }
+
+        if (!position_moved[index.position]) {
+          position_moved[index.position] = true;
+          mesh->positions[index.position] = point(mesh->positions[index.position]);
+        }
+        if (!normal_moved[index.normal]) {
+          normal_moved[index.normal] = true;
+          mesh->normals[index.normal] = normal(mesh->normals[index.normal]);
+        }
+      }
+    }
+
+    for (uint32_t i = begin; i < end; i++) {
+      const Primitive& p = m_primitives[i];
+      if (p.type == Primitive::TRIANGLE && p.triangle.mesh == mesh.get()) mesh->compute_edges(p.triangle.face);
+    }
+  }
+
+  for (uint32_t i = begin; i < end; i++) {
+    Primitive& p = m_primitives[i];
 
-glm::dvec3 Scene::center() const { return m_bvh->root()->bbox.center(); }
+    if (p.type == Primitive::TRIANGLE) {
+      p.bbox = AABB(p.triangle);
+    } else {
+      // spheres only support uniform scaling
+      p.sphere.center = point(p.sphere.center);
+      p.sphere.radius *= glm::length(glm::dvec3(transform[0]));
+      p.bbox = AABB(p.sphere);
+    }
 
-glm::dvec3 Scene::size() const { return m_bvh->root()->bbox.size(); }
+    if (p.is_light()) {
+      for (Primitive& light : m_lights) {
+        if (light.id == p.id) light = p;
+      }
+    }
+  }
+}
+
+glm::dvec3 Scene::center() const { return accelerator().bounds().center(); }
 
-struct Vertex {
-  glm::dvec3 pos{};
-  glm::dvec3 normal{};
-  glm::dvec2 uv{};
-  int material_id = -1;
-};
+glm::dvec3 Scene::size() const { return accelerator().bounds().size(); }
 
 std::vector<Primitive> Scene::load_obj(const std::filesystem::path& filename)
 {
@@ -167,71 +431,64 @@ std::vector<Primitive> Scene::load_obj(const std::filesystem::path& filename)
     (void)add_material(material);
   }
 
-  std::vector<Vertex> vertices;
+  // the attribute arrays are shared by all shapes of the file, only the index triples are per face
+  auto mesh = std::make_unique<Mesh>();
+  mesh->positions.reserve(attrib.vertices.size() / 3);
+  for (size_t i = 0; i + 2 < attrib.vertices.size(); i += 3) {
+    mesh->positions.emplace_back(attrib.vertices[i], attrib.vertices[i + 1], attrib.vertices[i + 2]);
+  }
+  mesh->normals.reserve(attrib.normals.size() / 3 + 1);
+  for (size_t i = 0; i + 2 < attrib.normals.size(); i += 3) {
+    mesh->normals.emplace_back(attrib.normals[i], attrib.normals[i + 1], attrib.normals[i + 2]);
+  }
+  mesh->texcoords.reserve(attrib.texcoords.size() / 2 + 1);
+  for (size_t i = 0; i + 1 < attrib.texcoords.size(); i += 2) {
+    mesh->texcoords.emplace_back(attrib.texcoords[i], attrib.texcoords[i + 1]);
+  }
+
+  // corners without a normal or texture coordinate share one zero entry at the end
+  const uint32_t no_normal = uint32_t(mesh->normals.size());
+  const uint32_t no_texcoord = uint32_t(mesh->texcoords.size());
+  mesh->normals.emplace_back(0, 0, 0);
+  mesh->texcoords.emplace_back(0, 0);
+
+  std::vector<int> material_ids;
 
   for (size_t s = 0; s < shapes.size(); s++) {
     size_t index_offset = 0;
     for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
       size_t fv = size_t(shapes[s].mesh.num_face_vertices[f]);
 
-      int material_id = shapes[s].mesh.material_ids[f];
-
       for (size_t v = 0; v < fv; v++) {
         tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-
-        Vertex vertex;
-
-        tinyobj::real_t vx = attrib.vertices[3 * size_t(idx.vertex_index) + 0];
-        tinyobj::real_t vy = attrib.vertices[3 * size_t(idx.vertex_index) + 1];
-        tinyobj::real_t vz = attrib.vertices[3 * size_t(idx.vertex_index) + 2];
-        vertex.pos = {vx, vy, vz};
-
-        if (idx.texcoord_index >= 0) {
-          tinyobj::real_t tx = attrib.texcoords[2 * size_t(idx.texcoord_index) + 0];
-          tinyobj::real_t ty = attrib.texcoords[2 * size_t(idx.texcoord_index) + 1];
-          vertex.uv = {tx, ty};
-        } else {
-          vertex.uv = {0, 0};
-        }
-
-        if (idx.normal_index >= 0) {
-          tinyobj::real_t nx = attrib.normals[3 * size_t(idx.normal_index) + 0];
-          tinyobj::real_t ny = attrib.normals[3 * size_t(idx.normal_index) + 1];
-          tinyobj::real_t nz = attrib.normals[3 * size_t(idx.normal_index) + 2];
-          vertex.normal = {nx, ny, nz};
-        } else {
-          vertex.normal = {0, 0, 0};
-        }
-
-        vertex.material_id = material_id;
-        vertices.push_back(vertex);
+        Mesh::Index index;
+        index.position = uint32_t(idx.vertex_index);
+        index.normal = idx.normal_index >= 0 ? uint32_t(idx.normal_index) : no_normal;
+        index.texcoord = idx.texcoord_index >= 0 ? uint32_t(idx.texcoord_index) : no_texcoord;
+        mesh->indices.push_back(index);
       }
+
+      material_ids.push_back(shapes[s].mesh.material_ids[f]);
       index_offset += fv;
     }
   }
 
+  mesh->compute_edges();
+
   std::vector<Primitive> triangles;
 
   Material* default_material = add_material(Material{.albedo = glm::dvec3(0.5)});
 
-  size_t triangle_count = vertices.size() / 3;
+  size_t triangle_count = mesh->face_count();
+  triangles.reserve(triangle_count);
   for (size_t i = 0; i < triangle_count; i++) {
-    Triangle tri;
-    tri.v0 = vertices[i * 3 + 0].pos;
-    tri.v1 = vertices[i * 3 + 1].pos;
-    tri.v2 = vertices[i * 3 + 2].pos;
-    tri.t0 = vertices[i * 3 + 0].uv;
-    tri.t1 = vertices[i * 3 + 1].uv;
-    tri.t2 = vertices[i * 3 + 2].uv;
-    tri.n0 = vertices[i * 3 + 0].normal;
-    tri.n1 = vertices[i * 3 + 1].normal;
-    tri.n2 = vertices[i * 3 + 2].normal;
+    Triangle tri(mesh.get(), uint32_t(i));
 
 #if 1
     if (mtls.empty()) {
       triangles.push_back(Primitive(tri, default_material));
     } else {
-      int id = offset + vertices[i * 3].material_id;
+      int id = offset + material_ids[i];
       Material* m = &m_materials[id];
       triangles.push_back(Primitive(tri, m));
     }
@@ -240,6 +497,10 @@ std::vector<Primitive> Scene::load_obj(const std::filesystem::path& filename)
 #endif
   }
 
+  std::cout << __FUNCTION__ << " Mesh Memory: " << double(mesh->memory()) / (1024.0 * 1024.0) << " MiB"
+            << std::endl;
+  m_mesh_data.push_back(std::move(mesh));
+
   std::cout << __FUNCTION__ << " Triangles: " << triangles.size() << std::endl;
   return triangles;
 }
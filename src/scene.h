@@ -1,7 +1,13 @@
 
 #pragma once
 
+#include "accelerator.h"
 #include "bvh.h"
+#include "bvh4.h"
+#include "grid.h"
+#include "kdtree.h"
+#include "qbvh.h"
+#include "tlas.h"
 #include "geometry.h"
 #include "material.h"
 #include "ray.h"
@@ -11,16 +17,42 @@
 #include <atomic>
 #include <cstdint>
 
+struct AcceleratorConfig {
+  enum Type : uint8_t { BVH, KD_TREE, GRID };
+  Type type = BVH;  // structure the primitives that are not instanced are traced with
+  BVHConfig bvh;
+  KdTreeConfig kd_tree;
+  GridConfig grid;
+};
+
 class Scene
 {
  public:
   Scene();
-  void compute_bvh();
+  // construct the accelerator the config selects, the only place that knows the concrete backends
+  void compute_accelerator(const AcceleratorConfig& config = AcceleratorConfig());
+  // refit the BVH to moved primitives, rebuilds it instead once refitting degraded it too much, the other
+  // accelerators are always rebuilt
+  void update_accelerator();
+  // move the primitives [begin, end) and only those, call update_accelerator() before rendering the next frame
+  void transform_primitives(uint32_t begin, uint32_t end, const glm::dmat4& transform);
+  // place a model, every model is loaded and gets its own BVH only once no matter how often it is placed
+  void add_instance(const std::filesystem::path& filename, const glm::dmat4& transform);
+  void set_instance_transform(uint32_t instance, const glm::dmat4& transform);
+  int instance_count() const;
+  // BVH over the primitives that are not instanced, null when another accelerator is used for them
+  const BVH* bvh() const { return m_bvh.get(); }
   void add_primitive(const Primitive& p);
   void add_primitives(const std::vector<Primitive>::iterator begin, const std::vector<Primitive>::iterator end);
   Material* add_material(const Material& m);
   std::vector<Primitive> load_obj(const std::filesystem::path& filename);
-  std::optional<Intersection> find_intersection(const Ray&) const;
+  std::optional<Hit> find_intersection(const Ray&) const;
+  // closest hits of all rays of a packet, hits needs room for packet.size results
+  void find_intersections(const RayPacket& packet, std::optional<Hit>* hits) const;
+  // surface attributes of a hit found for the same ray, only computed for hits that are shaded
+  Intersection resolve_hit(const Ray&, const Hit&) const;
+  // true if anything blocks the ray before t_max
+  bool occluded(const Ray&, real t_max) const;
   glm::dvec3 sample_background(const Ray&) const;
   int primitive_count();
   glm::dvec3 center() const;
@@ -32,10 +64,28 @@ class Scene
   std::vector<Primitive> lights() const;
 
  private:
+  void compute_tlas();
+  void add_instance_lights(const Instance&);
+  void collapse_bvh();
+  const Accelerator& accelerator() const;
+
   uint32_t m_count;
   std::vector<Primitive> m_primitives;
   std::vector<Primitive> m_lights;
+  // emitters of the instances in world space, sampled together with m_lights
+  std::vector<Primitive> m_instance_lights;
+  Mesh m_instance_light_mesh;
   std::unique_ptr<BVH> m_bvh;
+  // traces the primitives that are not instanced instead of m_bvh, a wide BVH, kd-tree or grid
+  std::unique_ptr<Accelerator> m_accelerator;
+  AcceleratorConfig m_accelerator_config;
+  // attributes and indices of every loaded OBJ file, the triangle primitives point into them
+  std::vector<std::unique_ptr<Mesh>> m_mesh_data;
+  std::vector<std::filesystem::path> m_mesh_paths;
+  std::vector<std::vector<Primitive>> m_meshes;
+  std::vector<std::unique_ptr<BVH>> m_mesh_bvhs;
+  std::vector<Instance> m_instances;
+  std::unique_ptr<TLAS> m_tlas;
   size_t m_material_count = 0;
   std::array<Material, 256> m_materials;
   std::unique_ptr<Image> m_background_texture;
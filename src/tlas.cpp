@@ -0,0 +1,191 @@
+#include "tlas.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+// entering an instance costs a whole BVH traversal, so the top level always ends in single instance leaves
+static BVHConfig top_level_config(const BVHConfig& config)
+{
+  BVHConfig c = config;
+  c.min_leaf_size = 1;
+  c.max_leaf_size = 1;
+  return c;
+}
+
+TLAS::TLAS(const std::vector<const BVH*>& meshes, const std::vector<Instance>& instances, const BVHConfig& config)
+    : m_instances(place(meshes, instances)), m_top(instance_bounds(m_instances), top_level_config(config))
+{
+  std::cout << "TLAS Instances: " << m_instances.size() << ", Meshes: " << meshes.size()
+            << ", Nodes: " << m_top.node_count() << std::endl;
+}
+
+std::vector<TLAS::Placement> TLAS::place(const std::vector<const BVH*>& meshes, const std::vector<Instance>& instances)
+{
+  std::vector<Placement> placements;
+  placements.reserve(instances.size());
+
+  for (const Instance& instance : instances) {
+    Placement p;
+    p.mesh = meshes[instance.mesh];
+    p.transform = instance.transform;
+    p.inverse = glm::inverse(instance.transform);
+    p.normal_transform = glm::transpose(glm::inverse(glm::dmat3(instance.transform)));
+    p.identity = (instance.transform == glm::dmat4(1.0));
+    placements.push_back(p);
+  }
+
+  return placements;
+}
+
+// world space bounds of the transformed object space bounds
+std::vector<AABB> TLAS::instance_bounds(const std::vector<Placement>& instances)
+{
+  std::vector<AABB> boxes;
+  boxes.reserve(instances.size());
+
+  for (const Placement& p : instances) {
+    const AABB& local = p.mesh->bounds();
+    glm::dvec3 min(std::numeric_limits<double>::max()), max(std::numeric_limits<double>::lowest());
+
+    for (int corner = 0; corner < 8; corner++) {
+      glm::dvec3 c((corner & 1) ? local.max.x : local.min.x, (corner & 2) ? local.max.y : local.min.y,
+                   (corner & 4) ? local.max.z : local.min.z);
+      glm::dvec3 w = glm::dvec3(p.transform * glm::dvec4(c, 1.0));
+      min = glm::min(min, w);
+      max = glm::max(max, w);
+    }
+
+    boxes.push_back(AABB(min, max));
+  }
+
+  return boxes;
+}
+
+// The direction is not normalized, so distances along the object space ray equal the world space ones.
+Ray TLAS::to_object_space(const Placement& p, const Ray& ray)
+{
+  if (p.identity) return ray;
+  return Ray{glm::dvec3(p.inverse * glm::dvec4(ray.origin, 1.0)),
+             glm::dvec3(p.inverse * glm::dvec4(ray.direction, 0.0))};
+}
+
+std::optional<Hit> TLAS::traverse(const Ray& ray) const
+{
+  const auto& nodes = m_top.nodes();
+  const auto& indices = m_top.indices();
+  if (m_instances.empty()) return std::nullopt;
+
+  const RayInv ray_inv(ray);
+  real t_max = 1e9;
+  Interval<float> ti = Interval<float>(float(ray_epsilon), std::nextafter(float(t_max), 1e9f));
+
+  std::optional<Hit> result = std::nullopt;
+
+  struct Entry {
+    uint32_t index;
+    float t_entry;
+  };
+
+  Entry stack[BVH::max_depth];
+  size_t stack_size = 0;
+  uint64_t visits = 0;
+  float t_entry;
+
+  if (ray_vs_aabb(ray_inv, nodes[0].min, nodes[0].max, ti, t_entry)) stack[stack_size++] = {0, t_entry};
+
+  while (stack_size > 0) {
+    Entry entry = stack[--stack_size];
+    if (entry.t_entry > ti.max) continue;
+
+    const BVH::Node& node = nodes[entry.index];
+    visits++;
+
+    if (node.is_leaf()) {
+      for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+        const Placement& instance = m_instances[indices[i]];
+        auto hit = instance.mesh->traverse(to_object_space(instance, ray), t_max, visits);
+        if (hit.has_value()) {
+          result = hit;
+          result->instance = indices[i];
+          t_max = hit->t;
+          ti.max = std::nextafter(float(t_max), std::numeric_limits<float>::max());
+        }
+      }
+      continue;
+    }
+
+    // push the farther child first, so the nearer one is visited next
+    uint32_t left = node.offset, right = node.offset + 1;
+    float t_left, t_right;
+    bool hit_left = ray_vs_aabb(ray_inv, nodes[left].min, nodes[left].max, ti, t_left);
+    bool hit_right = ray_vs_aabb(ray_inv, nodes[right].min, nodes[right].max, ti, t_right);
+
+    if (hit_left && hit_right && t_left < t_right) {
+      stack[stack_size++] = {right, t_right};
+      stack[stack_size++] = {left, t_left};
+    } else {
+      if (hit_left) stack[stack_size++] = {left, t_left};
+      if (hit_right) stack[stack_size++] = {right, t_right};
+    }
+  }
+
+  count_ray(visits);
+  return result;
+}
+
+Intersection TLAS::surface(const Ray& ray, const Hit& hit) const
+{
+  const Placement& instance = m_instances[hit.instance];
+  Intersection surface = hit.primitive->surface(to_object_space(instance, ray), hit.t, hit.barycentrics);
+
+  if (!instance.identity) {
+    surface.point = ray.point_at(hit.t);
+    surface.normal = glm::normalize(instance.normal_transform * surface.normal);
+    surface.geometric_normal = glm::normalize(instance.normal_transform * surface.geometric_normal);
+  }
+
+  return surface;
+}
+
+bool TLAS::occluded(const Ray& ray, real t_max) const
+{
+  const auto& nodes = m_top.nodes();
+  const auto& indices = m_top.indices();
+  if (m_instances.empty()) return false;
+
+  const RayInv ray_inv(ray);
+  const Interval<float> ti = Interval<float>(float(ray_epsilon), std::nextafter(float(t_max), 1e9f));
+
+  uint32_t stack[BVH::max_depth];
+  size_t stack_size = 0;
+  stack[stack_size++] = 0;
+  uint64_t visits = 0;
+
+  while (stack_size > 0) {
+    const uint32_t index = stack[--stack_size];
+    const BVH::Node& node = nodes[index];
+    float t_entry;
+    visits++;
+
+    if (!ray_vs_aabb(ray_inv, node.min, node.max, ti, t_entry)) continue;
+
+    if (!node.is_leaf()) {
+      stack[stack_size++] = node.offset + 1;
+      stack[stack_size++] = node.offset;
+      continue;
+    }
+
+    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+      const Placement& instance = m_instances[indices[i]];
+      if (instance.mesh->occluded(to_object_space(instance, ray), t_max, visits)) {
+        count_ray(visits);
+        return true;
+      }
+    }
+  }
+
+  count_ray(visits);
+  return false;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "aabb.h"
+#include "accelerator.h"
+#include "bvh.h"
+#include "geometry.h"
+
+// placement of a mesh in the scene
+struct Instance {
+  uint32_t mesh;         // index of the bottom level BVH
+  glm::dmat4 transform;  // object to world space
+};
+
+// Two-level acceleration structure. Every unique mesh has its own bottom level BVH in object space, the
+// top level BVH is built over the world space bounds of the instances. Rays are transformed into object
+// space when they reach an instance. The bottom level BVHs are not owned and have to outlive this one.
+class TLAS : public Accelerator
+{
+ public:
+  TLAS(const std::vector<const BVH*>& meshes, const std::vector<Instance>& instances,
+       const BVHConfig& config = BVHConfig());
+  std::optional<Hit> traverse(const Ray&) const override;
+  bool occluded(const Ray&, real t_max) const override;
+  // surface attributes of a hit found by traverse() for the same ray, in world space
+  Intersection surface(const Ray&, const Hit&) const;
+  const AABB& bounds() const override { return m_top.bounds(); }
+  size_t instance_count() const { return m_instances.size(); }
+
+ private:
+
+  struct Placement {
+    const BVH* mesh;
+    glm::dmat4 transform;
+    glm::dmat4 inverse;
+    glm::dmat3 normal_transform;
+    bool identity;  // skip transforming rays and hits
+  };
+
+  std::vector<Placement> m_instances;
+  BVH m_top;
+
+  static std::vector<Placement> place(const std::vector<const BVH*>& meshes, const std::vector<Instance>& instances);
+  static std::vector<AABB> instance_bounds(const std::vector<Placement>& instances);
+  static Ray to_object_space(const Placement&, const Ray&);
+};
@@ -5,6 +5,12 @@
 #include <random>
 #include <array>
 #include <iostream>
+#include <cstdlib>
+#include <new>
+
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#endif
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/io.hpp>
@@ -36,6 +42,48 @@ struct Interval {
   }
 };
 
+// hint the cpu to pull the cache line at address into the cache
+inline void prefetch(const void* address)
+{
+#if defined(_MSC_VER)
+  _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+  __builtin_prefetch(address);
+#endif
+}
+
+// allocator for std::vector that aligns the storage, e.g. to cache lines
+template <typename T, size_t Alignment = 64>
+struct AlignedAllocator {
+  using value_type = T;
+
+  template <typename U>
+  struct rebind {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  AlignedAllocator() = default;
+
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&)
+  {
+  }
+
+  T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment))); }
+  void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U, Alignment>&) const
+  {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U, Alignment>&) const
+  {
+    return false;
+  }
+};
+
 template <typename T>
 inline T map_range(const T& value, const Interval<T>& in, const Interval<T>& out)
 {